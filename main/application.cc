@@ -11,6 +11,7 @@
 #include "settings.h"
 
 #include <cstring>
+#include <algorithm>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -73,6 +74,13 @@ void Application::Initialize() {
     audio_service_.Initialize(codec);
     audio_service_.Start();
 
+    // Start the uplink task before the encoder can report packets
+    xTaskCreate([](void* arg) {
+        Application* app = (Application*)arg;
+        app->AudioSendTask();
+        vTaskDelete(NULL);
+    }, "audio_send", AUDIO_SEND_TASK_STACK_SIZE, this, CONFIG_AUDIO_SEND_TASK_PRIORITY, &audio_send_task_handle_);
+
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
@@ -83,6 +91,9 @@ void Application::Initialize() {
     callbacks.on_vad_change = [this](bool speaking) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+    callbacks.on_wake_word_speech = [this]() {
+        xEventGroupSetBits(event_group_, MAIN_EVENT_PRE_CONNECT);
+    };
     audio_service_.SetCallbacks(callbacks);
 
     // Add state change listeners
@@ -162,15 +173,40 @@ void Application::Initialize() {
     display->UpdateStatusBar(true);
 }
 
+void Application::AudioSendTask() {
+    while (true) {
+        // Only this task waits for MAIN_EVENT_SEND_AUDIO, Run() leaves the bit alone
+        xEventGroupWaitBits(event_group_, MAIN_EVENT_SEND_AUDIO, pdTRUE, pdFALSE, portMAX_DELAY);
+
+        // Send everything that is ready in one batch, e.g. the backlog after a network stall
+        if (audio_service_.PopPacketsFromSendQueue(send_audio_batch_) > 0) {
+            // The oldest packet of the batch is traced, the transport takes the packets
+            int64_t capture_time = send_audio_batch_.front()->origin_time_us;
+            int64_t encode_time = send_audio_batch_.front()->stage_time_us;
+            // The writes may block on a slow link, so they run outside the lock the main loop also takes
+            std::unique_lock<std::mutex> lock(protocol_mutex_);
+            auto protocol = protocol_;
+            lock.unlock();
+            if (protocol && protocol->SendAudioBatch(send_audio_batch_)) {
+                auto& latency_tracer = audio_service_.latency_tracer();
+                int64_t send_time = esp_timer_get_time();
+                latency_tracer.Record(kAudioLatencySend, encode_time, send_time);
+                latency_tracer.Record(kAudioLatencyUplink, capture_time, send_time);
+            }
+        }
+        send_audio_batch_.clear();
+    }
+}
+
 void Application::Run() {
     // Set the priority of the main task to 10
     vTaskPrioritySet(nullptr, 10);
 
     const EventBits_t ALL_EVENTS = 
         MAIN_EVENT_SCHEDULE |
-        MAIN_EVENT_SEND_AUDIO |
         MAIN_EVENT_WAKE_WORD_DETECTED |
         MAIN_EVENT_VAD_CHANGE |
+        MAIN_EVENT_PRE_CONNECT |
         MAIN_EVENT_CLOCK_TICK |
         MAIN_EVENT_ERROR |
         MAIN_EVENT_NETWORK_CONNECTED |
@@ -217,14 +253,6 @@ void Application::Run() {
             HandleStopListeningEvent();
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
-        }
-
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
             HandleWakeWordDetectedEvent();
         }
@@ -236,6 +264,10 @@ void Application::Run() {
             }
         }
 
+        if (bits & MAIN_EVENT_PRE_CONNECT) {
+            HandlePreConnectEvent();
+        }
+
         if (bits & MAIN_EVENT_SCHEDULE) {
             std::unique_lock<std::mutex> lock(mutex_);
             auto tasks = std::move(main_tasks_);
@@ -249,10 +281,15 @@ void Application::Run() {
             clock_ticks_++;
             auto display = Board::GetInstance().GetDisplay();
             display->UpdateStatusBar();
+
+            if (protocol_) {
+                protocol_->CheckPreConnection();
+            }
         
             // Print debug info every 10 seconds
             if (clock_ticks_ % 10 == 0) {
                 SystemInfo::PrintHeapStats();
+                audio_service_.latency_tracer().Log();
             }
         }
     }
@@ -477,6 +514,7 @@ void Application::InitializeProtocol() {
 
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
+    std::unique_lock<std::mutex> protocol_lock(protocol_mutex_);
     if (ota_->HasMqttConfig()) {
         protocol_ = std::make_unique<MqttProtocol>();
     } else if (ota_->HasWebsocketConfig()) {
@@ -485,6 +523,7 @@ void Application::InitializeProtocol() {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
         protocol_ = std::make_unique<MqttProtocol>();
     }
+    protocol_lock.unlock();
 
     protocol_->OnConnected([this]() {
         DismissAlert();
@@ -496,7 +535,7 @@ void Application::InitializeProtocol() {
     });
     
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (GetDeviceState() == kDeviceStateSpeaking) {
+        if (GetDeviceState() == kDeviceStateSpeaking && !aborted_) {
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
         }
     });
@@ -507,6 +546,7 @@ void Application::InitializeProtocol() {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
+        audio_service_.SetEncoderProfile(protocol_->encoder_profile());
     });
     
     protocol_->OnAudioChannelClosed([this, &board]() {
@@ -518,91 +558,107 @@ void Application::InitializeProtocol() {
         });
     });
     
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    SetDeviceState(kDeviceStateSpeaking);
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (GetDeviceState() == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
+    protocol_->OnIncomingJson([this, display](const JsonMessage& message) {
+        switch (message.type()) {
+            case kJsonMessageTts: {
+                auto state = message.GetStringView("state");
+                if (state == "start") {
+                    Schedule([this]() {
+                        aborted_ = false;
+                        // Speech follows right away, start the speaker before the first packet needs it
+                        audio_service_.power_governor().Wake(kAudioPowerOutput);
+                        SetDeviceState(kDeviceStateSpeaking);
+                    });
+                } else if (state == "stop") {
+                    Schedule([this]() {
+                        if (GetDeviceState() == kDeviceStateSpeaking) {
+                            if (listening_mode_ == kListeningModeManualStop) {
+                                SetDeviceState(kDeviceStateIdle);
+                            } else {
+                                SetDeviceState(kDeviceStateListening);
+                            }
                         }
+                    });
+                } else if (state == "sentence_start") {
+                    std::string text;
+                    if (message.GetString("text", text)) {
+                        ESP_LOGI(TAG, "<< %s", text.c_str());
+                        Schedule([display, text = std::move(text)]() {
+                            display->SetChatMessage("assistant", text.c_str());
+                        });
                     }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
+                }
+                break;
+            }
+            case kJsonMessageStt: {
+                std::string text;
+                if (message.GetString("text", text)) {
+                    ESP_LOGI(TAG, ">> %s", text.c_str());
+                    Schedule([display, text = std::move(text)]() {
+                        display->SetChatMessage("user", text.c_str());
                     });
                 }
+                break;
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
+            case kJsonMessageLlm: {
+                std::string emotion;
+                if (message.GetString("emotion", emotion)) {
+                    Schedule([display, emotion_str = std::move(emotion)]() {
+                        display->SetEmotion(emotion_str.c_str());
+                    });
+                }
+                break;
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
+            case kJsonMessageMcp: {
+                // Only the payload is parsed into a cJSON tree, the envelope has already been scanned
+                auto payload = message.Find("payload");
+                if (payload != nullptr && payload->kind == kJsonValueObject) {
+                    McpServer::GetInstance().ParseMessage(payload->value);
+                }
+                break;
             }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
-                McpServer::GetInstance().ParseMessage(payload);
+            case kJsonMessageSystem: {
+                std::string command;
+                if (message.GetString("command", command)) {
+                    ESP_LOGI(TAG, "System command: %s", command.c_str());
+                    if (command == "reboot") {
+                        // Do a reboot if user requests a OTA update
+                        Schedule([this]() {
+                            Reboot();
+                        });
+                    } else {
+                        ESP_LOGW(TAG, "Unknown system command: %s", command.c_str());
+                    }
+                }
+                break;
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
-                    // Do a reboot if user requests a OTA update
-                    Schedule([this]() {
-                        Reboot();
-                    });
+            case kJsonMessageAlert: {
+                std::string status, alert_message, emotion;
+                if (message.GetString("status", status) && message.GetString("message", alert_message) &&
+                    message.GetString("emotion", emotion)) {
+                    Alert(status.c_str(), alert_message.c_str(), emotion.c_str(), Lang::Sounds::OGG_VIBRATION);
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Alert command requires status, message and emotion");
                 }
-            }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::OGG_VIBRATION);
-            } else {
-                ESP_LOGW(TAG, "Alert command requires status, message and emotion");
+                break;
             }
 #if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
-            if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
-                });
-            } else {
-                ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+            case kJsonMessageCustom: {
+                auto payload = message.Find("payload");
+                ESP_LOGI(TAG, "Received custom message: %.*s", (int)message.text().size(), message.text().data());
+                if (payload != nullptr && payload->kind == kJsonValueObject) {
+                    Schedule([this, display, payload_str = std::string(payload->value)]() {
+                        display->SetChatMessage("system", payload_str.c_str());
+                    });
+                } else {
+                    ESP_LOGW(TAG, "Invalid custom message format: missing payload");
+                }
+                break;
             }
 #endif
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+            default:
+                ESP_LOGW(TAG, "Unknown message type: %.*s", (int)message.type_name().size(), message.type_name().data());
+                break;
         }
     });
     
@@ -627,7 +683,7 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
         digit_sound{'9', Lang::Sounds::OGG_9}
     }};
 
-    // This sentence uses 9KB of SRAM, so we need to wait for it to finish
+    // The sounds are queued and played back in order by the decoder task, PlaySound() returns immediately
     Alert(Lang::Strings::ACTIVATION, message.c_str(), "link", Lang::Sounds::OGG_ACTIVATION);
 
     for (const auto& digit : code) {
@@ -673,6 +729,7 @@ void Application::StopListening() {
 
 void Application::HandleToggleChatEvent() {
     auto state = GetDeviceState();
+    audio_service_.power_governor().Wake(kAudioPowerInput);
     
     if (state == kDeviceStateActivating) {
         SetDeviceState(kDeviceStateIdle);
@@ -727,6 +784,7 @@ void Application::ContinueOpenAudioChannel(ListeningMode mode) {
 
 void Application::HandleStartListeningEvent() {
     auto state = GetDeviceState();
+    audio_service_.power_governor().Wake(kAudioPowerInput);
     
     if (state == kDeviceStateActivating) {
         SetDeviceState(kDeviceStateIdle);
@@ -777,13 +835,17 @@ void Application::HandleWakeWordDetectedEvent() {
     if (!protocol_) {
         return;
     }
+    // A popup or a reply is about to play
+    audio_service_.power_governor().Wake(kAudioPowerOutput);
 
     auto state = GetDeviceState();
     auto wake_word = audio_service_.GetLastWakeWord();
     ESP_LOGI(TAG, "Wake word detected: %s (state: %d)", wake_word.c_str(), (int)state);
 
     if (state == kDeviceStateIdle) {
+#if CONFIG_SEND_WAKE_WORD_DATA
         audio_service_.EncodeWakeWord();
+#endif
         auto wake_word = audio_service_.GetLastWakeWord();
 
         if (!protocol_->IsAudioChannelOpened()) {
@@ -800,7 +862,7 @@ void Application::HandleWakeWordDetectedEvent() {
     } else if (state == kDeviceStateSpeaking || state == kDeviceStateListening) {
         AbortSpeaking(kAbortReasonWakeWordDetected);
         // Clear send queue to avoid sending residues to server
-        while (audio_service_.PopPacketFromSendQueue());
+        audio_service_.ClearSendQueue();
 
         if (state == kDeviceStateListening) {
             protocol_->SendStartListening(GetDefaultListeningMode());
@@ -819,6 +881,51 @@ void Application::HandleWakeWordDetectedEvent() {
     }
 }
 
+void Application::HandlePreConnectEvent() {
+#if CONFIG_PRECONNECT_ON_VOICE_ACTIVITY
+    // Someone is talking while we wait for the wake word, set up the connection while they finish it
+    if (!protocol_ || GetDeviceState() != kDeviceStateIdle || protocol_->IsAudioChannelOpened()) {
+        return;
+    }
+    // One attempt at a time, and none during the back-off after a failure
+    if (esp_timer_get_time() < preconnect_retry_time_us_ || preconnect_running_.exchange(true)) {
+        return;
+    }
+    if (xTaskCreate([](void* arg) {
+        Application* app = static_cast<Application*>(arg);
+        app->PreConnectTask();
+        app->preconnect_running_ = false;
+        vTaskDelete(NULL);
+    }, "preconnect", PRECONNECT_TASK_STACK_SIZE, this, 2, nullptr) != pdPASS) {
+        preconnect_running_ = false;
+    }
+#endif
+}
+
+void Application::PreConnectTask() {
+#if CONFIG_PRECONNECT_ON_VOICE_ACTIVITY
+    // Lock order: preconnect_mutex_, then protocol_mutex_, the same as ResetProtocol()
+    std::lock_guard<std::mutex> preconnect_lock(preconnect_mutex_);
+    std::unique_lock<std::mutex> protocol_lock(protocol_mutex_);
+    auto protocol = protocol_;
+    protocol_lock.unlock();
+    if (!protocol) {
+        return;
+    }
+
+    if (protocol->PreConnect(CONFIG_PRECONNECT_KEEP_ALIVE_SECONDS)) {
+        preconnect_retry_ms_ = 0;
+        preconnect_retry_time_us_ = 0;
+        return;
+    }
+    int retry_ms = preconnect_retry_ms_ == 0 ? PRECONNECT_RETRY_MIN_MS
+        : std::min(preconnect_retry_ms_ * 2, PRECONNECT_RETRY_MAX_MS);
+    preconnect_retry_ms_ = retry_ms;
+    preconnect_retry_time_us_ = esp_timer_get_time() + (int64_t)retry_ms * 1000;
+    ESP_LOGW(TAG, "Pre-connect failed, not retrying for %d ms", retry_ms);
+#endif
+}
+
 void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     // Check state again in case it was changed during scheduling
     if (GetDeviceState() != kDeviceStateConnecting) {
@@ -846,7 +953,7 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     SetListeningMode(GetDefaultListeningMode());
 #else
     // Set flag to play popup sound after state changes to listening
-    // (PlaySound here would be cleared by ResetDecoder in EnableVoiceProcessing)
+    // (so it marks the moment the device actually starts listening)
     play_popup_on_listening_ = true;
     SetListeningMode(GetDefaultListeningMode());
 #endif
@@ -860,6 +967,13 @@ void Application::HandleStateChangedEvent() {
     auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
+
+    // Write smaller output chunks while talking, fewer and larger ones otherwise
+    auto latency_mode = kAudioLatencyModePowerSave;
+    if (new_state == kDeviceStateListening || new_state == kDeviceStateSpeaking) {
+        latency_mode = listening_mode_ == kListeningModeRealtime ? kAudioLatencyModeLowLatency : kAudioLatencyModeBalanced;
+    }
+    board.GetAudioCodec()->SetLatencyMode(latency_mode);
     
     switch (new_state) {
         case kDeviceStateUnknown:
@@ -900,7 +1014,7 @@ void Application::HandleStateChangedEvent() {
             audio_service_.EnableWakeWordDetection(false);
 #endif
             
-            // Play popup sound after ResetDecoder (in EnableVoiceProcessing) has been called
+            // Play popup sound now that the device is listening
             if (play_popup_on_listening_) {
                 play_popup_on_listening_ = false;
                 audio_service_.PlaySound(Lang::Sounds::OGG_POPUP);
@@ -937,6 +1051,8 @@ void Application::Schedule(std::function<void()>&& callback) {
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+    // Stop playing right away instead of waiting for the server to stop sending
+    audio_service_.AbortPlayback();
     if (protocol_) {
         protocol_->SendAbortSpeaking(reason);
     }
@@ -957,7 +1073,12 @@ void Application::Reboot() {
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
     }
-    protocol_.reset();
+    {
+        // Wait for a pre-connect that is still using the protocol
+        std::lock_guard<std::mutex> preconnect_lock(preconnect_mutex_);
+        std::lock_guard<std::mutex> lock(protocol_mutex_);
+        protocol_.reset();
+    }
     audio_service_.Stop();
 
     vTaskDelay(pdMS_TO_TICKS(1000));
@@ -1024,7 +1145,9 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     auto state = GetDeviceState();
     
     if (state == kDeviceStateIdle) {
+#if CONFIG_SEND_WAKE_WORD_DATA
         audio_service_.EncodeWakeWord();
+#endif
 
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
@@ -1112,7 +1235,9 @@ void Application::ResetProtocol() {
         if (protocol_ && protocol_->IsAudioChannelOpened()) {
             protocol_->CloseAudioChannel();
         }
-        // Reset protocol
+        // Reset protocol once a running pre-connect is done with it, the audio send task keeps its own reference
+        std::lock_guard<std::mutex> preconnect_lock(preconnect_mutex_);
+        std::lock_guard<std::mutex> lock(protocol_mutex_);
         protocol_.reset();
     });
 }
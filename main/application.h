@@ -10,6 +10,7 @@
 #include <mutex>
 #include <deque>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
@@ -19,7 +20,7 @@
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO           (1 << 1)
+#define MAIN_EVENT_SEND_AUDIO           (1 << 1)   // Handled by the audio send task, not Run()
 #define MAIN_EVENT_WAKE_WORD_DETECTED   (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE           (1 << 3)
 #define MAIN_EVENT_ERROR                (1 << 4)
@@ -31,6 +32,13 @@
 #define MAIN_EVENT_START_LISTENING      (1 << 10)
 #define MAIN_EVENT_STOP_LISTENING       (1 << 11)
 #define MAIN_EVENT_STATE_CHANGED        (1 << 12)
+#define MAIN_EVENT_PRE_CONNECT          (1 << 13)
+
+#define AUDIO_SEND_TASK_STACK_SIZE      (4096 * 2)
+#define PRECONNECT_TASK_STACK_SIZE      (4096 * 2)
+// A failed pre-connect is not retried before this back-off, which doubles up to the maximum
+#define PRECONNECT_RETRY_MIN_MS         5000
+#define PRECONNECT_RETRY_MAX_MS         120000
 
 
 enum AecMode {
@@ -126,7 +134,10 @@ private:
 
     std::mutex mutex_;
     std::deque<std::function<void()>> main_tasks_;
-    std::unique_ptr<Protocol> protocol_;
+    // Shared so the tasks that use it off the main loop keep it alive while they send or connect
+    std::shared_ptr<Protocol> protocol_;
+    // Held while protocol_ is replaced, and while another task takes a reference to it
+    std::mutex protocol_mutex_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
     DeviceStateMachine state_machine_;
@@ -134,14 +145,21 @@ private:
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> send_audio_batch_;
     std::unique_ptr<Ota> ota_;
 
     bool has_server_time_ = false;
-    bool aborted_ = false;
+    std::atomic<bool> aborted_ = false;
     bool assets_version_checked_ = false;
     bool play_popup_on_listening_ = false;  // Flag to play popup sound after state changes to listening
     int clock_ticks_ = 0;
     TaskHandle_t activation_task_handle_ = nullptr;
+    TaskHandle_t audio_send_task_handle_ = nullptr;
+    // Held by the pre-connect task while it uses the protocol, so a reset waits for it
+    std::mutex preconnect_mutex_;
+    std::atomic<bool> preconnect_running_ = false;
+    std::atomic<int> preconnect_retry_ms_ = 0;
+    std::atomic<int64_t> preconnect_retry_time_us_ = 0;
 
 
     // Event handlers
@@ -153,12 +171,19 @@ private:
     void HandleNetworkDisconnectedEvent();
     void HandleActivationDoneEvent();
     void HandleWakeWordDetectedEvent();
+    void HandlePreConnectEvent();
     void ContinueOpenAudioChannel(ListeningMode mode);
     void ContinueWakeWordInvoke(const std::string& wake_word);
 
     // Activation task (runs in background)
     void ActivationTask();
 
+    // Uplink audio task, sends the encoded packets so control work in Run() never delays them
+    void AudioSendTask();
+
+    // Pre-connect task, the TCP/TLS handshake runs here instead of blocking Run()
+    void PreConnectTask();
+
     // Helper methods
     void CheckAssetsVersion();
     void CheckNewVersion();
@@ -0,0 +1,100 @@
+#include "aec_delay_estimator.h"
+#include "pcm_kernels.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstdlib>
+
+#define TAG "AecDelayEstimator"
+
+void AecDelayEstimator::GenerateProbe(std::vector<int16_t>& pcm, int sample_rate) {
+    // 15-bit maximum length sequence (x^15 + x^14 + 1), white up to Nyquist and never repeats within the probe
+    size_t samples = (size_t)sample_rate * AEC_CALIBRATION_PROBE_MS / 1000;
+    pcm.resize(samples);
+    uint16_t lfsr = 0x7fff;
+    for (size_t i = 0; i < samples; i++) {
+        uint16_t bit = ((lfsr >> 14) ^ (lfsr >> 13)) & 1;
+        lfsr = ((lfsr << 1) | bit) & 0x7fff;
+        pcm[i] = bit ? AEC_CALIBRATION_PROBE_LEVEL : -AEC_CALIBRATION_PROBE_LEVEL;
+    }
+    // Ramp the edges so the speaker does not click
+    size_t fade = std::min(samples / 2, (size_t)sample_rate * AEC_CALIBRATION_PROBE_FADE_MS / 1000);
+    PcmApplyGainRamp(pcm.data(), fade, 0, 65536);
+    PcmApplyGainRamp(pcm.data() + samples - fade, fade, 65536, 0);
+}
+
+void AecDelayEstimator::Start(int channels, int sample_rate) {
+    channels_ = channels;
+    sample_rate_ = sample_rate;
+    capture_samples_ = (size_t)sample_rate * AEC_CALIBRATION_CAPTURE_MS / 1000;
+    microphone_.clear();
+    microphone_.reserve(capture_samples_);
+    reference_.clear();
+    reference_.reserve(capture_samples_);
+}
+
+bool AecDelayEstimator::Feed(const std::vector<int16_t>& data) {
+    if (channels_ < 2) {
+        return true;
+    }
+    for (size_t i = 0; i + channels_ <= data.size() && microphone_.size() < capture_samples_; i += channels_) {
+        microphone_.push_back(data[i]);
+        reference_.push_back(data[i + channels_ - 1]);
+    }
+    return microphone_.size() >= capture_samples_;
+}
+
+bool AecDelayEstimator::Estimate(AecDelayEstimate& estimate) {
+    int max_lag = sample_rate_ * AEC_CALIBRATION_MAX_DELAY_MS / 1000;
+    int skip = sample_rate_ * AEC_CALIBRATION_WINDOW_SKIP_MS / 1000;
+    int length = (int)reference_.size();
+
+    // The probe starts where the reference first gets loud
+    int onset = 0;
+    while (onset < length && std::abs(reference_[onset]) < AEC_CALIBRATION_PROBE_LEVEL / 16) {
+        onset++;
+    }
+    int start = onset + skip;
+    if (channels_ < 2 || start - max_lag < 0 || start + AEC_CALIBRATION_WINDOW_SAMPLES + max_lag > length) {
+        estimate.error = channels_ < 2 ? "No reference channel" : "The probe was not found on the reference channel";
+        Clear();
+        return false;
+    }
+
+    // mic[n] ~ ref[n - lag], over a window that stays inside the probe for every lag
+    int best_lag = 0;
+    int64_t best = 0;
+    int64_t total = 0;
+    for (int lag = -max_lag; lag <= max_lag; lag++) {
+        const int16_t* microphone = microphone_.data() + start;
+        const int16_t* reference = reference_.data() + start - lag;
+        int64_t sum = 0;
+        for (int i = 0; i < AEC_CALIBRATION_WINDOW_SAMPLES; i++) {
+            sum += (int32_t)microphone[i] * reference[i];
+        }
+        // The echo may come back inverted
+        sum = std::abs(sum);
+        total += sum;
+        if (sum > best) {
+            best = sum;
+            best_lag = lag;
+        }
+    }
+    Clear();
+
+    int64_t average = total / (2 * max_lag + 1);
+    estimate.peak_ratio = average > 0 ? (float)best / average : 0;
+    if (estimate.peak_ratio < AEC_CALIBRATION_MIN_PEAK_RATIO) {
+        estimate.error = "No clear echo, check the output volume and that the speaker is not muted";
+        return false;
+    }
+    estimate.delay_samples = best_lag;
+    estimate.reference_delay_samples = best_lag - sample_rate_ * AEC_REFERENCE_LEAD_MS / 1000;
+    ESP_LOGI(TAG, "Microphone lags the reference by %d samples (peak ratio %.1f)", best_lag, estimate.peak_ratio);
+    return true;
+}
+
+void AecDelayEstimator::Clear() {
+    microphone_ = std::vector<int16_t>();
+    reference_ = std::vector<int16_t>();
+}
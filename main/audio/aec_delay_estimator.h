@@ -0,0 +1,61 @@
+#ifndef AEC_DELAY_ESTIMATOR_H
+#define AEC_DELAY_ESTIMATOR_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#define AEC_CALIBRATION_PROBE_MS 1000
+#define AEC_CALIBRATION_PROBE_FADE_MS 10
+// About -15 dBFS before the output volume
+#define AEC_CALIBRATION_PROBE_LEVEL 6000
+#define AEC_CALIBRATION_CAPTURE_MS 1300
+// The probe reaches the speaker after the output queue and the DMA ring, the window starts once it plays
+#define AEC_CALIBRATION_WINDOW_SKIP_MS 100
+#define AEC_CALIBRATION_WINDOW_SAMPLES 8192
+// Largest delay searched for, in either direction
+#define AEC_CALIBRATION_MAX_DELAY_MS 64
+// The correlation peak must stand out this much from the average, or the echo was not heard
+#define AEC_CALIBRATION_MIN_PEAK_RATIO 6
+// The reference is kept slightly ahead of the echo, the AEC filter can only model a causal path
+#define AEC_REFERENCE_LEAD_MS 2
+
+struct AecDelayEstimate {
+    // How far the microphone lags the reference channel, negative if it leads
+    int delay_samples = 0;
+    // The delay to apply to the reference channel in the processor feed, negative delays the microphones
+    int reference_delay_samples = 0;
+    float peak_ratio = 0;
+    const char* error = nullptr;
+};
+
+/*
+ * Measures the delay between the microphone and the codec reference channel.
+ *
+ * A maximum length sequence is played while the input task records the first microphone and the reference
+ * channel. The reference hears the probe on the electrical path, the microphone through the speaker and the air,
+ * so the cross-correlation peaks at the lag between them. Boards differ a lot here (codec loopback, separate ADC,
+ * I2S slot order), which is why it is measured instead of assumed. Feed() runs on the input task, the rest on the
+ * caller's task, and never at the same time.
+ */
+class AecDelayEstimator {
+public:
+    // Fills pcm with the probe at the given sample rate
+    static void GenerateProbe(std::vector<int16_t>& pcm, int sample_rate);
+
+    void Start(int channels, int sample_rate);
+    // Interleaved input frames with the reference last, returns true once enough has been recorded
+    bool Feed(const std::vector<int16_t>& data);
+    // Frees the recording
+    bool Estimate(AecDelayEstimate& estimate);
+    void Clear();
+
+private:
+    int channels_ = 0;
+    int sample_rate_ = 0;
+    size_t capture_samples_ = 0;
+    std::vector<int16_t> microphone_;
+    std::vector<int16_t> reference_;
+};
+
+#endif // AEC_DELAY_ESTIMATOR_H
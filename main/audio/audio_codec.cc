@@ -1,9 +1,11 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "pcm_kernels.h"
 
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 #include <driver/i2s_common.h>
 
 #define TAG "AudioCodec"
@@ -18,6 +20,72 @@ void AudioCodec::OutputData(std::vector<int16_t>& data) {
     Write(data.data(), data.size());
 }
 
+bool AudioCodec::OutputData(std::vector<int16_t>& data, const std::atomic<uint32_t>& abort_epoch, uint32_t epoch) {
+    size_t chunk = data.size();
+    switch (latency_mode_.load()) {
+        case kAudioLatencyModeLowLatency:
+            chunk = output_sample_rate_ / 1000 * AUDIO_CODEC_LOW_LATENCY_CHUNK_MS;
+            break;
+        case kAudioLatencyModeBalanced:
+            chunk = output_sample_rate_ / 1000 * AUDIO_CODEC_BALANCED_CHUNK_MS;
+            break;
+        default:
+            break;
+    }
+    chunk = std::max<size_t>(chunk, 1);
+    size_t offset = 0;
+    while (offset < data.size()) {
+        if (abort_epoch.load() != epoch) {
+            size_t fade = std::min<size_t>(data.size() - offset,
+                (size_t)output_sample_rate_ / 1000 * AUDIO_CODEC_FADE_OUT_MS);
+            PcmApplyGainRamp(data.data() + offset, fade, 65536, 0);
+            Write(data.data() + offset, fade);
+            return false;
+        }
+        size_t samples = std::min(chunk, data.size() - offset);
+        Write(data.data() + offset, samples);
+        offset += samples;
+    }
+    return true;
+}
+
+void AudioCodec::SetLatencyMode(AudioLatencyMode mode) {
+    if (latency_mode_.exchange(mode) != mode) {
+        ESP_LOGI(TAG, "Output latency mode: %s", latency_mode_name());
+    }
+}
+
+const char* AudioCodec::latency_mode_name() const {
+    switch (latency_mode_.load()) {
+        case kAudioLatencyModeLowLatency:
+            return "low_latency";
+        case kAudioLatencyModePowerSave:
+            return "power_save";
+        default:
+            return "balanced";
+    }
+}
+
+void AudioCodec::FlushOutput() {
+    // Restarting TX drops the queued DMA buffers, the ring is preloaded with silence before it is enabled again.
+    // A duplex channel shares its clock with the microphone, so it is left alone.
+    if (tx_handle_ == nullptr || duplex_ || !output_enabled_) {
+        return;
+    }
+    if (i2s_channel_disable(tx_handle_) != ESP_OK) {
+        return;
+    }
+    static const uint8_t silence[256] = {};
+    size_t loaded;
+    do {
+        loaded = 0;
+        if (i2s_channel_preload_data(tx_handle_, silence, sizeof(silence), &loaded) != ESP_OK) {
+            break;
+        }
+    } while (loaded == sizeof(silence));
+    i2s_channel_enable(tx_handle_);
+}
+
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
     int samples = Read(data.data(), data.size());
     if (samples > 0) {
@@ -8,11 +8,32 @@
 #include <vector>
 #include <string>
 #include <functional>
+#include <atomic>
 
 #include "board.h"
 
+// The DMA ring is sized once when the channels are created, everything in it plays before newer audio
+#if CONFIG_AUDIO_CODEC_DMA_RING_LOW_LATENCY
+#define AUDIO_CODEC_DMA_DESC_NUM 4
+#define AUDIO_CODEC_DMA_FRAME_NUM 160
+#elif CONFIG_AUDIO_CODEC_DMA_RING_POWER_SAVE
+#define AUDIO_CODEC_DMA_DESC_NUM 8
+#define AUDIO_CODEC_DMA_FRAME_NUM 480
+#else
 #define AUDIO_CODEC_DMA_DESC_NUM 6
 #define AUDIO_CODEC_DMA_FRAME_NUM 240
+#endif
+
+// Abortable output is written in chunks, so an abort is noticed within one chunk, and faded out when cut
+#define AUDIO_CODEC_LOW_LATENCY_CHUNK_MS 5
+#define AUDIO_CODEC_BALANCED_CHUNK_MS 10
+#define AUDIO_CODEC_FADE_OUT_MS 4
+
+enum AudioLatencyMode {
+    kAudioLatencyModeLowLatency,    // Realtime conversation, small output chunks
+    kAudioLatencyModeBalanced,      // Turn-based conversation
+    kAudioLatencyModePowerSave,     // Idle, each frame is written at once so the output task wakes up less
+};
 
 class AudioCodec {
 public:
@@ -25,6 +46,12 @@ public:
     virtual void EnableOutput(bool enable);
 
     virtual void OutputData(std::vector<int16_t>& data);
+    // Returns false if abort_epoch no longer equals epoch, the value taken when data was produced.
+    // The rest of data is then dropped after a short fade-out.
+    bool OutputData(std::vector<int16_t>& data, const std::atomic<uint32_t>& abort_epoch, uint32_t epoch);
+    // Drops the output still queued for DMA, call it from the task that writes the output
+    virtual void FlushOutput();
+    void SetLatencyMode(AudioLatencyMode mode);
     virtual bool InputData(std::vector<int16_t>& data);
     virtual void Start();
 
@@ -38,6 +65,8 @@ public:
     inline float input_gain() const { return input_gain_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    inline AudioLatencyMode latency_mode() const { return latency_mode_; }
+    const char* latency_mode_name() const;
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -53,6 +82,7 @@ protected:
     int output_channels_ = 1;
     int output_volume_ = 70;
     float input_gain_ = 0.0;
+    std::atomic<AudioLatencyMode> latency_mode_{kAudioLatencyModeBalanced};
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
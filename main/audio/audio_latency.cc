@@ -0,0 +1,111 @@
+#include "audio_latency.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "AudioLatency"
+
+static size_t GetBucketIndex(uint32_t ms) {
+    if (ms < LATENCY_HISTOGRAM_LINEAR_BUCKETS) {
+        return ms;
+    }
+    int octave = 31 - __builtin_clz(ms);
+    if (octave >= LATENCY_HISTOGRAM_MAX_OCTAVE + 1) {
+        return LATENCY_HISTOGRAM_BUCKETS - 1;
+    }
+    int shift = octave - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    size_t sub_bucket = (ms >> shift) & ((1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) - 1);
+    return LATENCY_HISTOGRAM_LINEAR_BUCKETS + (octave - 4) * (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket;
+}
+
+static uint32_t GetBucketUpperBound(size_t index) {
+    if (index < LATENCY_HISTOGRAM_LINEAR_BUCKETS) {
+        return index;
+    }
+    index -= LATENCY_HISTOGRAM_LINEAR_BUCKETS;
+    int octave = 4 + index / (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+    uint32_t sub_bucket = index % (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS);
+    int shift = octave - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    return (((1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS) + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(int64_t elapsed_us) {
+    uint32_t ms = elapsed_us > 0 ? (uint32_t)(elapsed_us / 1000) : 0;
+    buckets_[GetBucketIndex(ms)]++;
+    count_++;
+    if (ms > max_ms_) {
+        max_ms_ = ms;
+    }
+}
+
+uint32_t LatencyHistogram::Percentile(int percentile) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    uint64_t target = ((uint64_t)count_ * percentile + 99) / 100;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < buckets_.size(); i++) {
+        sum += buckets_[i];
+        if (sum >= target) {
+            // The last bucket is open ended
+            return i == buckets_.size() - 1 ? max_ms_ : std::min(GetBucketUpperBound(i), max_ms_);
+        }
+    }
+    return max_ms_;
+}
+
+const char* AudioLatencyTracer::GetStageName(AudioLatencyStage stage) {
+    switch (stage) {
+        case kAudioLatencyProcess: return "process";
+        case kAudioLatencyEncode: return "encode";
+        case kAudioLatencySend: return "send";
+        case kAudioLatencyUplink: return "uplink";
+        case kAudioLatencyDecode: return "decode";
+        case kAudioLatencyPlayback: return "playback";
+        case kAudioLatencyDownlink: return "downlink";
+        default: return "unknown";
+    }
+}
+
+void AudioLatencyTracer::Record(AudioLatencyStage stage, int64_t start_time_us, int64_t end_time_us) {
+    if (start_time_us <= 0) {
+        return;
+    }
+    histograms_[stage].Record(end_time_us - start_time_us);
+}
+
+void AudioLatencyTracer::Log() {
+    uint32_t total = 0;
+    for (auto& histogram : histograms_) {
+        total += histogram.count();
+    }
+    if (total == logged_count_) {
+        return;
+    }
+    logged_count_ = total;
+
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto& histogram = histograms_[i];
+        if (histogram.count() == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%-8s n=%lu p50=%lu p95=%lu p99=%lu max=%lu ms", GetStageName((AudioLatencyStage)i),
+            histogram.count(), histogram.Percentile(50), histogram.Percentile(95), histogram.Percentile(99),
+            histogram.max_ms());
+    }
+}
+
+cJSON* AudioLatencyTracer::GetJson() const {
+    cJSON* json = cJSON_CreateObject();
+    for (int i = 0; i < kAudioLatencyStageCount; i++) {
+        auto& histogram = histograms_[i];
+        cJSON* stage = cJSON_CreateObject();
+        cJSON_AddNumberToObject(stage, "count", histogram.count());
+        cJSON_AddNumberToObject(stage, "p50", histogram.Percentile(50));
+        cJSON_AddNumberToObject(stage, "p95", histogram.Percentile(95));
+        cJSON_AddNumberToObject(stage, "p99", histogram.Percentile(99));
+        cJSON_AddNumberToObject(stage, "max", histogram.max_ms());
+        cJSON_AddItemToObject(json, GetStageName((AudioLatencyStage)i), stage);
+    }
+    return json;
+}
@@ -0,0 +1,66 @@
+#ifndef AUDIO_LATENCY_H
+#define AUDIO_LATENCY_H
+
+#include <array>
+#include <cstdint>
+#include <cJSON.h>
+
+/*
+ * Latency histogram in milliseconds, 1 ms buckets below 16 ms, then 8 buckets per octave
+ * (at most 12.5% error) up to 16 s. Each histogram is written by one task only.
+ */
+#define LATENCY_HISTOGRAM_LINEAR_BUCKETS 16
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 3
+#define LATENCY_HISTOGRAM_MAX_OCTAVE 13
+#define LATENCY_HISTOGRAM_BUCKETS (LATENCY_HISTOGRAM_LINEAR_BUCKETS + \
+    (LATENCY_HISTOGRAM_MAX_OCTAVE - 3) * (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS))
+
+class LatencyHistogram {
+public:
+    void Record(int64_t elapsed_us);
+
+    uint32_t count() const { return count_; }
+    uint32_t max_ms() const { return max_ms_; }
+    // Upper bound of the bucket that holds the given percentile (0 - 100)
+    uint32_t Percentile(int percentile) const;
+
+private:
+    std::array<uint32_t, LATENCY_HISTOGRAM_BUCKETS> buckets_ = {};
+    uint32_t count_ = 0;
+    uint32_t max_ms_ = 0;
+};
+
+enum AudioLatencyStage {
+    // Uplink: capture -> processor output -> encoded -> sent
+    kAudioLatencyProcess,
+    kAudioLatencyEncode,
+    kAudioLatencySend,
+    kAudioLatencyUplink,
+    // Downlink: received -> decoded -> written to I2S
+    kAudioLatencyDecode,
+    kAudioLatencyPlayback,
+    kAudioLatencyDownlink,
+    kAudioLatencyStageCount,
+};
+
+/*
+ * Per-stage latency of the audio frames. Every stage includes the time spent waiting in the queue
+ * in front of it, so the stages of one direction add up to its end-to-end latency.
+ */
+class AudioLatencyTracer {
+public:
+    void Record(AudioLatencyStage stage, int64_t start_time_us, int64_t end_time_us);
+
+    // Logs the percentiles if frames were traced since the last call
+    void Log();
+    // {"process": {"count": 100, "p50": 12, "p95": 20, "p99": 24, "max": 31}, ...} in milliseconds
+    cJSON* GetJson() const;
+
+    static const char* GetStageName(AudioLatencyStage stage);
+
+private:
+    std::array<LatencyHistogram, kAudioLatencyStageCount> histograms_;
+    uint32_t logged_count_ = 0;
+};
+
+#endif // AUDIO_LATENCY_H
@@ -0,0 +1,96 @@
+#include "audio_mixer.h"
+#include "pcm_kernels.h"
+
+#include <algorithm>
+
+void AudioMixer::Initialize(int sample_rate) {
+    ducking_hold_samples_ = (size_t)sample_rate * AUDIO_MIXER_DUCKING_HOLD_MS / 1000;
+}
+
+void AudioMixer::SetGain(AudioMixerChannel channel, int gain) {
+    inputs_[channel].gain = std::clamp(gain, 0, AUDIO_MIXER_UNITY_GAIN);
+}
+
+bool AudioMixer::NeedsInput(AudioMixerChannel channel) const {
+    return inputs_[channel].remaining() == 0;
+}
+
+void AudioMixer::Put(AudioMixerChannel channel, std::vector<int16_t>& pcm) {
+    auto& input = inputs_[channel];
+    input.pcm.swap(pcm);
+    input.offset = 0;
+}
+
+void AudioMixer::RequestFlush(AudioMixerChannel channel) {
+    inputs_[channel].flush_requested = true;
+}
+
+bool AudioMixer::Empty() const {
+    for (auto& input : inputs_) {
+        if (input.remaining() > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AudioMixer::Mix(std::vector<int16_t>& output) {
+    size_t block = SIZE_MAX;
+    int active_count = 0;
+    Input* active = nullptr;
+    for (auto& input : inputs_) {
+        if (input.flush_requested.exchange(false)) {
+            input.offset = input.pcm.size();
+        }
+        input.block_samples = 0;
+        if (input.remaining() > 0) {
+            block = std::min(block, input.remaining());
+            active_count++;
+            active = &input;
+        }
+    }
+    if (active_count == 0) {
+        return false;
+    }
+
+    if (inputs_[kAudioMixerChannelSound].remaining() > 0) {
+        ducking_remaining_ = ducking_hold_samples_;
+    }
+    int target_gains[kAudioMixerChannelCount];
+    for (int i = 0; i < kAudioMixerChannelCount; i++) {
+        target_gains[i] = inputs_[i].gain;
+    }
+    if (ducking_remaining_ > 0) {
+        target_gains[kAudioMixerChannelVoice] = (int)((int64_t)target_gains[kAudioMixerChannelVoice] *
+            AUDIO_MIXER_DUCKING_GAIN / AUDIO_MIXER_UNITY_GAIN);
+        ducking_remaining_ = ducking_remaining_ > block ? ducking_remaining_ - block : 0;
+    }
+
+    // A whole frame alone at unity gain is passed through
+    int active_index = active - inputs_.data();
+    if (active_count == 1 && active->offset == 0 && block == active->pcm.size() &&
+        active->current_gain == AUDIO_MIXER_UNITY_GAIN && target_gains[active_index] == AUDIO_MIXER_UNITY_GAIN) {
+        output.swap(active->pcm);
+        active->block_samples = block;
+        active->pcm.clear();
+        active->offset = 0;
+        for (int i = 0; i < kAudioMixerChannelCount; i++) {
+            inputs_[i].current_gain = target_gains[i];
+        }
+        return true;
+    }
+
+    mix_buffer_.assign(block, 0);
+    for (int i = 0; i < kAudioMixerChannelCount; i++) {
+        auto& input = inputs_[i];
+        if (input.remaining() > 0) {
+            PcmMixTo32(input.pcm.data() + input.offset, mix_buffer_.data(), block, input.current_gain, target_gains[i]);
+            input.offset += block;
+            input.block_samples = block;
+        }
+        input.current_gain = target_gains[i];
+    }
+    output.resize(block);
+    PcmConvert32To16(mix_buffer_.data(), output.data(), block, 0);
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Q16 gains, 65536 is unity
+#define AUDIO_MIXER_UNITY_GAIN 65536
+// The voice is lowered to about 30% while a sound plays
+#define AUDIO_MIXER_DUCKING_GAIN 19660
+// How long the voice stays ducked after the last sound frame, so gaps between sounds do not pump
+#define AUDIO_MIXER_DUCKING_HOLD_MS 300
+
+enum AudioMixerChannel {
+    kAudioMixerChannelVoice,    // Network audio and the audio testing loopback
+    kAudioMixerChannelSound,    // Local sounds (PlaySound)
+    kAudioMixerChannelCount,
+};
+
+/*
+ * Mixes the playback channels into the blocks sent to the codec.
+ *
+ * Each channel holds one PCM frame at the output sample rate. Put() swaps buffers with the caller, so no samples
+ * are copied in, and a lone channel at unity gain is swapped out again without mixing. Otherwise each block is as
+ * long as the shortest pending frame. Gain changes, including ducking the voice under a sound, ramp over a block.
+ * Only the output task uses it, except RequestFlush() which may be called from any task.
+ */
+class AudioMixer {
+public:
+    void Initialize(int sample_rate);
+    void SetGain(AudioMixerChannel channel, int gain);
+
+    // The channel has played all of its frame and takes the next one
+    bool NeedsInput(AudioMixerChannel channel) const;
+    void Put(AudioMixerChannel channel, std::vector<int16_t>& pcm);
+    // Drops what is left of the channel's frame the next time Mix() runs
+    void RequestFlush(AudioMixerChannel channel);
+    bool Empty() const;
+
+    // Returns false if no channel has anything to play
+    bool Mix(std::vector<int16_t>& output);
+    // How many samples of the channel's frame went into the last block, 0 if it was silent
+    size_t block_samples(AudioMixerChannel channel) const { return inputs_[channel].block_samples; }
+
+private:
+    struct Input {
+        std::vector<int16_t> pcm;
+        size_t offset = 0;
+        size_t block_samples = 0;
+        int gain = AUDIO_MIXER_UNITY_GAIN;
+        int current_gain = AUDIO_MIXER_UNITY_GAIN;
+        std::atomic<bool> flush_requested{false};
+
+        size_t remaining() const { return pcm.size() - offset; }
+    };
+
+    std::array<Input, kAudioMixerChannelCount> inputs_;
+    std::vector<int32_t> mix_buffer_;
+    size_t ducking_hold_samples_ = 0;
+    size_t ducking_remaining_ = 0;
+};
+
+#endif // AUDIO_MIXER_H
@@ -0,0 +1,159 @@
+#include "audio_power_governor.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "AudioPowerGovernor"
+
+static const int64_t kTimeoutsUs[kAudioPowerDirectionCount] = {
+    AUDIO_POWER_INPUT_TIMEOUT_MS * 1000LL,
+    AUDIO_POWER_OUTPUT_TIMEOUT_MS * 1000LL,
+};
+
+static const char* const kDirectionNames[kAudioPowerDirectionCount] = {
+    "input",
+    "output",
+};
+
+AudioPowerGovernor::~AudioPowerGovernor() {
+    if (timer_ != nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+    }
+}
+
+void AudioPowerGovernor::Initialize(AudioCodec* codec, std::function<void()> on_all_off) {
+    codec_ = codec;
+    on_all_off_ = on_all_off;
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            auto governor = (AudioPowerGovernor*)arg;
+            governor->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "audio_power_timer",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&timer_args, &timer_);
+}
+
+void AudioPowerGovernor::Start() {
+    // Whatever the codec left on starts its off delay now
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < kAudioPowerDirectionCount; i++) {
+        if (IsOn((AudioPowerDirection)i)) {
+            last_activity_us_[i] = now;
+            powered_on_us_[i] = now;
+        }
+    }
+    ScheduleLocked(now);
+}
+
+void AudioPowerGovernor::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(timer_);
+}
+
+bool AudioPowerGovernor::IsOn(AudioPowerDirection direction) const {
+    return direction == kAudioPowerInput ? codec_->input_enabled() : codec_->output_enabled();
+}
+
+void AudioPowerGovernor::NoteActivity(AudioPowerDirection direction) {
+    last_activity_us_[direction] = esp_timer_get_time();
+    if (!IsOn(direction)) {
+        PowerOn(direction, false);
+    }
+}
+
+void AudioPowerGovernor::Wake(AudioPowerDirection direction) {
+    last_activity_us_[direction] = esp_timer_get_time();
+    if (!IsOn(direction)) {
+        PowerOn(direction, true);
+    }
+}
+
+void AudioPowerGovernor::PowerOn(AudioPowerDirection direction, bool predicted) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (IsOn(direction)) {
+        return;
+    }
+    if (direction == kAudioPowerInput) {
+        codec_->EnableInput(true);
+    } else {
+        codec_->EnableOutput(true);
+    }
+    int64_t now = esp_timer_get_time();
+    powered_on_us_[direction] = now;
+    auto& statistics = statistics_[direction];
+    statistics.power_on_count++;
+    if (predicted) {
+        statistics.predicted_count++;
+    } else {
+        statistics.cold_start_count++;
+    }
+    ESP_LOGI(TAG, "Audio %s on (%s)", kDirectionNames[direction], predicted ? "predicted" : "cold start");
+    ScheduleLocked(now);
+}
+
+void AudioPowerGovernor::OnTimer() {
+    bool all_off = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < kAudioPowerDirectionCount; i++) {
+            auto direction = (AudioPowerDirection)i;
+            if (!IsOn(direction) || now - last_activity_us_[i] < kTimeoutsUs[i]) {
+                continue;
+            }
+            if (direction == kAudioPowerInput) {
+                codec_->EnableInput(false);
+            } else {
+                codec_->EnableOutput(false);
+            }
+            statistics_[i].on_time_us += now - powered_on_us_[i];
+            ESP_LOGI(TAG, "Audio %s off", kDirectionNames[i]);
+        }
+        ScheduleLocked(now);
+        all_off = !IsOn(kAudioPowerInput) && !IsOn(kAudioPowerOutput);
+    }
+    if (all_off && on_all_off_) {
+        on_all_off_();
+    }
+}
+
+void AudioPowerGovernor::ScheduleLocked(int64_t now) {
+    // The earliest off deadline, activity after it was armed only moves the deadline later
+    int64_t delay = INT64_MAX;
+    for (int i = 0; i < kAudioPowerDirectionCount; i++) {
+        if (IsOn((AudioPowerDirection)i)) {
+            delay = std::min(delay, last_activity_us_[i] + kTimeoutsUs[i] - now);
+        }
+    }
+    esp_timer_stop(timer_);
+    if (delay != INT64_MAX) {
+        esp_timer_start_once(timer_, std::max<int64_t>(delay, 1000));
+    }
+}
+
+cJSON* AudioPowerGovernor::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    cJSON* json = cJSON_CreateObject();
+    for (int i = 0; i < kAudioPowerDirectionCount; i++) {
+        bool on = IsOn((AudioPowerDirection)i);
+        auto& statistics = statistics_[i];
+        int64_t on_time_us = statistics.on_time_us + (on ? now - powered_on_us_[i] : 0);
+        cJSON* direction = cJSON_CreateObject();
+        cJSON_AddBoolToObject(direction, "on", on);
+        cJSON_AddNumberToObject(direction, "power_on_count", statistics.power_on_count);
+        cJSON_AddNumberToObject(direction, "predicted_count", statistics.predicted_count);
+        cJSON_AddNumberToObject(direction, "cold_start_count", statistics.cold_start_count);
+        cJSON_AddNumberToObject(direction, "on_time_ms", (double)(on_time_us / 1000));
+        cJSON_AddNumberToObject(direction, "idle_ms", (double)((now - last_activity_us_[i]) / 1000));
+        cJSON_AddItemToObject(json, kDirectionNames[i], direction);
+    }
+    return json;
+}
@@ -0,0 +1,70 @@
+#ifndef AUDIO_POWER_GOVERNOR_H
+#define AUDIO_POWER_GOVERNOR_H
+
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include "audio_codec.h"
+
+// Each direction has its own off delay. The microphone is idle for long stretches only when nothing listens,
+// the speaker is woken ahead of time before a reply, so it can go off sooner.
+#define AUDIO_POWER_INPUT_TIMEOUT_MS 15000
+#define AUDIO_POWER_OUTPUT_TIMEOUT_MS 5000
+
+enum AudioPowerDirection {
+    kAudioPowerInput,
+    kAudioPowerOutput,
+    kAudioPowerDirectionCount,
+};
+
+struct AudioPowerStatistics {
+    uint32_t power_on_count = 0;
+    // Powered up by Wake() before any audio flowed
+    uint32_t predicted_count = 0;
+    // Powered up by the first frame itself, which then waits for the codec to start
+    uint32_t cold_start_count = 0;
+    int64_t on_time_us = 0;
+};
+
+/*
+ * Switches the codec input and output on and off.
+ *
+ * The audio tasks call NoteActivity() for every frame, which only stores a timestamp once the direction is on.
+ * A one-shot timer fires at the earliest off deadline instead of polling, and is not armed while both
+ * directions are off. Wake() powers a direction up when audio is expected soon (TTS start, listening starts),
+ * so the first syllable does not wait for the codec. The statistics show how often each case happens.
+ */
+class AudioPowerGovernor {
+public:
+    ~AudioPowerGovernor();
+
+    // on_all_off runs on the timer task when both directions have been switched off
+    void Initialize(AudioCodec* codec, std::function<void()> on_all_off);
+    void Start();
+    void Stop();
+
+    void NoteActivity(AudioPowerDirection direction);
+    void Wake(AudioPowerDirection direction);
+
+    cJSON* GetJson();
+
+private:
+    AudioCodec* codec_ = nullptr;
+    esp_timer_handle_t timer_ = nullptr;
+    std::function<void()> on_all_off_;
+    std::mutex mutex_;
+    std::atomic<int64_t> last_activity_us_[kAudioPowerDirectionCount] = {};
+    int64_t powered_on_us_[kAudioPowerDirectionCount] = {};
+    AudioPowerStatistics statistics_[kAudioPowerDirectionCount];
+
+    bool IsOn(AudioPowerDirection direction) const;
+    void PowerOn(AudioPowerDirection direction, bool predicted);
+    void OnTimer();
+    void ScheduleLocked(int64_t now);
+};
+
+#endif // AUDIO_POWER_GOVERNOR_H
@@ -20,7 +20,12 @@ public:
     virtual void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) = 0;
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
+    // Change the output frame size after Initialize(), takes effect with the next frame
+    virtual void SetFrameDuration(int frame_duration_ms) = 0;
     virtual void EnableDeviceAec(bool enable) = 0;
+    // Align the reference channel with the echo in the microphones, in input samples at 16 kHz.
+    // A positive delay holds back the reference, a negative one the microphones.
+    virtual void SetReferenceDelay(int samples) = 0;
 };
 
 #endif
@@ -1,26 +1,9 @@
 #include "audio_service.h"
+#include "pcm_kernels.h"
+#include "settings.h"
 #include <esp_log.h>
 #include <cstring>
-
-#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
-    (esp_ae_rate_cvt_cfg_t)                                  \
-    {                                                        \
-        .src_rate        = (uint32_t)(_src_rate),            \
-        .dest_rate       = (uint32_t)(_dest_rate),           \
-        .channel         = (uint8_t)(_channel),              \
-        .bits_per_sample = ESP_AUDIO_BIT16,                  \
-        .complexity      = 2,                                \
-        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
-    }
-
-#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
-    (esp_opus_dec_cfg_t)                                                                                  \
-    {                                                                                                     \
-        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
-        .channel        = ESP_AUDIO_MONO,                                                                 \
-        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
-        .self_delimited = false,                                                                          \
-    }
+#include <cassert>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -37,50 +20,73 @@
 
 #define TAG "AudioService"
 
+static MemoryPool<AudioTask, AUDIO_TASK_POOL_SIZE>& GetAudioTaskPool() {
+    static MemoryPool<AudioTask, AUDIO_TASK_POOL_SIZE> pool;
+    return pool;
+}
+
+static BufferPool<std::vector<int16_t>, AUDIO_TASK_PCM_POOL_SIZE>& GetPcmPool() {
+    static BufferPool<std::vector<int16_t>, AUDIO_TASK_PCM_POOL_SIZE> pool(AUDIO_TASK_PCM_MAX_CAPACITY);
+    return pool;
+}
+
+AudioTask::AudioTask() : pcm(GetPcmPool().Take()) {
+}
+
+AudioTask::~AudioTask() {
+    GetPcmPool().Recycle(pcm);
+}
+
+void* AudioTask::operator new(size_t size) {
+    assert(size == sizeof(AudioTask));
+    return GetAudioTaskPool().Allocate();
+}
+
+void AudioTask::operator delete(void* ptr) {
+    GetAudioTaskPool().Free(ptr);
+}
+
+void AudioTask::TrimPool() {
+    GetPcmPool().Trim();
+}
+
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
+    queue_event_group_ = xEventGroupCreate();
 }
 
 AudioService::~AudioService() {
     if (event_group_ != nullptr) {
         vEventGroupDelete(event_group_);
     }
+    if (queue_event_group_ != nullptr) {
+        vEventGroupDelete(queue_event_group_);
+    }
     if (opus_encoder_ != nullptr) {
         esp_opus_enc_close(opus_encoder_);
     }
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-    }
     if (input_resampler_ != nullptr) {
         esp_ae_rate_cvt_close(input_resampler_);
     }
-    if (output_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(output_resampler_);
-    }
 }
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-    } else {
-        decoder_sample_rate_ = codec->output_sample_rate();
-        decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        decoder_frame_size_ = decoder_sample_rate_ / 1000 * OPUS_FRAME_DURATION_MS;
-    }
-    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-    ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
+    /* Other formats are opened when their first packet arrives */
+    decoder_pool_.Initialize(codec->output_sample_rate());
+    decoder_pool_.Get(kAudioMixerChannelVoice, codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG(encoder_profile_);
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
     if (opus_encoder_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
     } else {
         encoder_sample_rate_ = 16000;
-        encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
+        encoder_duration_ms_ = encoder_profile_.frame_duration_ms;
         esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
         encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+        encoder_output_buffer_.resize(encoder_outbuf_size_);
     }
 
     if (codec->input_sample_rate() != 16000) {
@@ -97,6 +103,22 @@ void AudioService::Initialize(AudioCodec* codec) {
 #else
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
+    {
+        Settings settings("audio", false);
+        audio_processor_->SetReferenceDelay(settings.GetInt("aec_ref_delay", 0));
+    }
+
+    mixer_.Initialize(codec->output_sample_rate());
+    playout_tracker_.Initialize(codec->output_sample_rate(), AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM);
+    sound_cache_.Initialize(codec->output_sample_rate());
+    sound_demuxer_ = std::make_unique<OggDemuxer>();
+    sound_demuxer_->OnDemuxerFinished([this](const uint8_t* data, int sample_rate, size_t size) {
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->sample_rate = sample_rate;
+        packet->frame_duration = 60;
+        packet->payload.assign(data, data + size);
+        sound_packets_.push_back(std::move(packet));
+    });
 
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
         PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
@@ -109,24 +131,18 @@ void AudioService::Initialize(AudioCodec* codec) {
         }
     });
 
-    esp_timer_create_args_t audio_power_timer_args = {
-        .callback = [](void* arg) {
-            AudioService* audio_service = (AudioService*)arg;
-            audio_service->CheckAndUpdateAudioPowerState();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "audio_power_timer",
-        .skip_unhandled_events = true,
-    };
-    esp_timer_create(&audio_power_timer_args, &audio_power_timer_);
+    power_governor_.Initialize(codec, []() {
+        // Nothing is streaming, give the recycled buffers back to the heap
+        AudioTask::TrimPool();
+        AudioStreamPacket::TrimPool();
+    });
 }
 
 void AudioService::Start() {
     service_stopped_ = false;
     xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    esp_timer_start_periodic(audio_power_timer_, 1000000);
+    power_governor_.Start();
 
 #if CONFIG_USE_AUDIO_PROCESSOR
     /* Start the audio input task */
@@ -158,35 +174,47 @@ void AudioService::Start() {
     }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
 #endif
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encoder and decoder tasks, so uplink and downlink do not wait for each other */
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusEncodeTask();
+        vTaskDelete(NULL);
+    }, "opus_encode", OPUS_ENCODE_TASK_STACK_SIZE, this, CONFIG_OPUS_ENCODE_TASK_PRIORITY,
+        &opus_encode_task_handle_, AS_TASK_CORE_ID(CONFIG_OPUS_ENCODE_TASK_CORE));
+
+    xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
+        audio_service->OpusDecodeTask();
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 12, this, 2, &opus_codec_task_handle_);
+    }, "opus_decode", OPUS_DECODE_TASK_STACK_SIZE, this, CONFIG_OPUS_DECODE_TASK_PRIORITY,
+        &opus_decode_task_handle_, AS_TASK_CORE_ID(CONFIG_OPUS_DECODE_TASK_CORE));
 }
 
 void AudioService::Stop() {
-    esp_timer_stop(audio_power_timer_);
+    power_governor_.Stop();
     service_stopped_ = true;
     xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    sound_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        sound_queue_.clear();
+        sound_discard_ = true;
+    }
+    mixer_.RequestFlush(kAudioMixerChannelVoice);
+    mixer_.RequestFlush(kAudioMixerChannelSound);
+    /* Wake up every waiter so they can see service_stopped_ */
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_ALL_EVENTS);
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
-    if (!codec_->input_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-        codec_->EnableInput(true);
-    }
+    power_governor_.NoteActivity(kAudioPowerInput);
 
     if (codec_->input_sample_rate() != sample_rate) {
         data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
@@ -198,12 +226,12 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
             uint32_t in_sample_num = data.size() / codec_->input_channels();
             uint32_t output_samples = 0;
             esp_ae_rate_cvt_get_max_out_sample_num(input_resampler_, in_sample_num, &output_samples);
-            auto resampled = std::vector<int16_t>(output_samples * codec_->input_channels());
+            input_resample_buffer_.resize(output_samples * codec_->input_channels());
             uint32_t actual_output = output_samples;
             esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)data.data(), in_sample_num,
-                                   (esp_ae_sample_t)resampled.data(), &actual_output);
-            resampled.resize(actual_output * codec_->input_channels());
-            data = std::move(resampled);
+                                   (esp_ae_sample_t)input_resample_buffer_.data(), &actual_output);
+            data.assign(input_resample_buffer_.begin(),
+                        input_resample_buffer_.begin() + actual_output * codec_->input_channels());
         }
     } else {
         data.resize(samples * codec_->input_channels());
@@ -212,8 +240,7 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
         }
     }
 
-    /* Update the last input time */
-    last_input_time_ = std::chrono::steady_clock::now();
+    last_capture_time_us_ = esp_timer_get_time();
     debug_statistics_.input_count++;
 
 #if CONFIG_USE_AUDIO_DEBUGGER
@@ -228,10 +255,11 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
 }
 
 void AudioService::AudioInputTask() {
+    bool audio_testing = false;
     while (true) {
         EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
-            pdFALSE, pdFALSE, portMAX_DELAY);
+            AS_EVENT_AUDIO_TESTING_STOP | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING |
+            AS_EVENT_AEC_CALIBRATION_RUNNING | AS_EVENT_AEC_CALIBRATION_STOP, pdFALSE, pdFALSE, portMAX_DELAY);
 
         if (service_stopped_) {
             break;
@@ -242,34 +270,61 @@ void AudioService::AudioInputTask() {
             continue;
         }
 
-        /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
+        /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button.
+         * This task is the only consumer of audio_testing_queue_, it drains it on start and plays it back on stop. */
+        if (bits & AS_EVENT_AUDIO_TESTING_STOP) {
+            xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_STOP);
+            audio_testing = false;
+            PlayAudioTestingPackets();
+            continue;
+        }
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (!audio_testing) {
+                /* Reclaim the slots left over from the previous test before recording again */
+                std::unique_ptr<AudioStreamPacket> packet;
+                while (audio_testing_queue_.Pop(packet)) {
+                }
+                audio_testing = true;
+            }
+            if (audio_testing_queue_.Size() >= MAX_TESTING_PACKETS_IN_QUEUE) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
             std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
+            int samples = encoder_duration_ms_ * 16000 / 1000;
             if (ReadAudioData(data, 16000, samples)) {
                 // If input channels is 2, we need to fetch the left channel data
                 if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                    size_t frames = data.size() / 2;
+                    PcmExtractChannel(data.data(), data.data(), frames, 2, 0);
+                    data.resize(frames);
                 }
                 PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
                 continue;
             }
         }
 
-        /* Feed the wake word and/or audio processor */
-        if (bits & (AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING)) {
+        /* An AEC calibration that timed out is dropped, only this task clears RUNNING so the estimator is free after DONE */
+        if (bits & AS_EVENT_AEC_CALIBRATION_STOP) {
+            if (bits & AS_EVENT_AEC_CALIBRATION_RUNNING) {
+                xEventGroupClearBits(event_group_, AS_EVENT_AEC_CALIBRATION_STOP | AS_EVENT_AEC_CALIBRATION_RUNNING);
+                xEventGroupSetBits(event_group_, AS_EVENT_AEC_CALIBRATION_DONE);
+            } else {
+                xEventGroupClearBits(event_group_, AS_EVENT_AEC_CALIBRATION_STOP);
+            }
+            continue;
+        }
+
+        /* Feed the wake word, the audio processor and the AEC calibration from the same frame */
+        if (bits & (AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING | AS_EVENT_AEC_CALIBRATION_RUNNING)) {
             int samples = 160; // 10ms
             std::vector<int16_t> data;
             if (ReadAudioData(data, 16000, samples)) {
+                if ((bits & AS_EVENT_AEC_CALIBRATION_RUNNING) && aec_estimator_.Feed(data)) {
+                    xEventGroupClearBits(event_group_, AS_EVENT_AEC_CALIBRATION_RUNNING);
+                    xEventGroupSetBits(event_group_, AS_EVENT_AEC_CALIBRATION_DONE);
+                }
                 if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
                     wake_word_->Feed(data);
                 }
@@ -289,245 +344,340 @@ void AudioService::AudioInputTask() {
 
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        /* Taken before anything is popped, so a block mixed before an abort is cut when it is written */
+        uint32_t abort_epoch = playback_abort_epoch_.load();
 
-        if (!codec_->output_enabled()) {
-            esp_timer_stop(audio_power_timer_);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-            codec_->EnableOutput(true);
+        /* Each mixer channel takes the next frame of its playback queue once it has played the last one */
+        bool popped = false;
+        std::unique_ptr<AudioTask> voice_task;
+        if (mixer_.NeedsInput(kAudioMixerChannelVoice) && audio_playback_queue_.Pop(voice_task)) {
+            mixer_.Put(kAudioMixerChannelVoice, voice_task->pcm);
+#if CONFIG_USE_SERVER_AEC
+            playout_tracker_.PutVoiceFrame(voice_task->timestamp);
+#endif
+            popped = true;
+        }
+        std::unique_ptr<AudioTask> sound_task;
+        if (mixer_.NeedsInput(kAudioMixerChannelSound)) {
+            if (sound_playback_queue_.Pop(sound_task)) {
+                mixer_.Put(kAudioMixerChannelSound, sound_task->pcm);
+                popped = true;
+            } else if (aec_probe_pending_) {
+                PutAecProbeFrame();
+            }
+        }
+        if (popped) {
+            xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_FULL);
         }
 
-        codec_->OutputData(task->pcm);
+        if (!mixer_.Mix(mixer_output_)) {
+            NotifyIfPlaybackIdle();
+            xEventGroupWaitBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_EMPTY, pdTRUE, pdFALSE, portMAX_DELAY);
+            continue;
+        }
 
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
+        power_governor_.NoteActivity(kAudioPowerOutput);
 
 #if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
+        int64_t write_start_time = esp_timer_get_time();
+#endif
+        bool written = codec_->OutputData(mixer_output_, playback_abort_epoch_, abort_epoch);
+        if (!written) {
+            codec_->FlushOutput();
+        }
+
+        int64_t output_time = esp_timer_get_time();
+#if CONFIG_USE_SERVER_AEC
+        /* Record when the block will be heard, for the server AEC timestamps */
+        if (written) {
+            playout_tracker_.OnOutput(mixer_output_.size(), mixer_.block_samples(kAudioMixerChannelVoice),
+                write_start_time, output_time);
+        } else {
+            playout_tracker_.Reset();
         }
 #endif
+        for (auto task : {voice_task.get(), sound_task.get()}) {
+            if (task == nullptr) {
+                continue;
+            }
+            debug_statistics_.playback_count++;
+            latency_tracer_.Record(kAudioLatencyPlayback, task->stage_time_us, output_time);
+            latency_tracer_.Record(kAudioLatencyDownlink, task->origin_time_us, output_time);
+        }
+        NotifyIfPlaybackIdle();
     }
 
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
-void AudioService::OpusCodecTask() {
+void AudioService::OpusDecodeTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_ != nullptr) {
-                task->pcm.resize(decoder_frame_size_);
-                esp_audio_dec_in_raw_t raw = {
-                    .buffer = (uint8_t *)(packet->payload.data()),
-                    .len = (uint32_t)(packet->payload.size()),
-                    .consumed = 0,
-                    .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
-                };
-                esp_audio_dec_out_frame_t out_frame = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
-                    .decoded_size = 0,
-                };
-                esp_audio_dec_info_t dec_info = {};
-                std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-                auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
-                decoder_lock.unlock();
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
-                    if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
-                        uint32_t target_size = 0;
-                        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, task->pcm.size(), &target_size);
-                        std::vector<int16_t> resampled(target_size);
-                        uint32_t actual_output = target_size;
-                        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
-                                                (esp_ae_sample_t)resampled.data(), &actual_output);
-                        resampled.resize(actual_output);
-                        task->pcm = std::move(resampled);
-                    }
-                    lock.lock();
-                    audio_playback_queue_.push_back(std::move(task));
-                    audio_queue_cv_.notify_all();
-                    debug_statistics_.decode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
-                    lock.lock();
-                }
-            } else {
-                ESP_LOGE(TAG, "Audio decoder is not configured");
-                lock.lock();
-            }
-            debug_statistics_.decode_count++;
+        /* Move the arrived packets into the jitter buffer, it puts them back in sequence order */
+        std::unique_ptr<AudioStreamPacket> packet;
+        while (!jitter_buffer_.Full() && audio_decode_queue_.Pop(packet)) {
+            xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_FULL);
+            jitter_buffer_.Put(std::move(packet));
         }
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-
-            if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
-                std::vector<uint8_t> buf(encoder_outbuf_size_);
-                esp_audio_enc_in_frame_t in = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
-                };
-                esp_audio_enc_out_frame_t out = {
-                    .buffer = buf.data(),
-                    .len = (uint32_t)encoder_outbuf_size_,
-                    .encoded_bytes = 0,
-                };
-                auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    packet->payload.assign(buf.data(), buf.data() + out.encoded_bytes);
-
-                    if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                        {
-                            std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                            audio_send_queue_.push_back(std::move(packet));
-                        }
-                        if (callbacks_.on_send_queue_available) {
-                            callbacks_.on_send_queue_available();
-                        }
-                    } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                        std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                        audio_testing_queue_.push_back(std::move(packet));
+
+        /* Local sounds are short and already in order, they skip the jitter buffer and go to their own
+           mixer channel, so they play over the network stream */
+        bool progressed = false;
+        if (!sound_playback_queue_.Full()) {
+            progressed = DecodeSoundFrame();
+        }
+
+        uint32_t wait_ms = 0;
+        if (!audio_playback_queue_.Full()) {
+            auto frame = jitter_buffer_.Get();
+            if (frame.type != kJitterBufferFrameNone) {
+                /* A lost frame is rebuilt from the in-band FEC of the next packet if it has arrived, otherwise concealed */
+                const AudioStreamPacket* source = frame.packet ? frame.packet.get() : frame.fec_packet;
+                auto task = DecodePacket(kAudioMixerChannelVoice, source, frame.type == kJitterBufferFrameLost);
+                if (task != nullptr) {
+                    task->timestamp = frame.packet ? frame.packet->timestamp : 0;
+                    task->origin_time_us = frame.packet ? frame.packet->origin_time_us : 0;
+                    latency_tracer_.Record(kAudioLatencyDecode, task->origin_time_us, task->stage_time_us);
+                    if (audio_playback_queue_.Push(std::move(task))) {
+                        xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_EMPTY);
                     }
-                    debug_statistics_.encode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
                 }
+                progressed = true;
             } else {
-                ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
-                         task->pcm.size(), encoder_frame_size_);
+                wait_ms = frame.wait_ms;
             }
-            lock.lock();
+        }
+
+        if (!progressed) {
+            NotifyIfPlaybackIdle();
+            xEventGroupWaitBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY | AS_QUEUE_PLAYBACK_NOT_FULL,
+                pdTRUE, pdFALSE, wait_ms > 0 ? pdMS_TO_TICKS(wait_ms) : portMAX_DELAY);
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    ESP_LOGW(TAG, "Opus decode task stopped");
 }
 
-void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
-        return;
-    }
+// Decoder task only, returns the PCM at the output sample rate or nullptr if it failed
+std::unique_ptr<AudioTask> AudioService::DecodePacket(AudioMixerChannel stream, const AudioStreamPacket* source, bool conceal) {
+    int64_t start_time = esp_timer_get_time();
+    debug_statistics_.decode_count++;
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-        opus_decoder_ = nullptr;
+    auto instance = source != nullptr ? decoder_pool_.Get(stream, source->sample_rate, source->frame_duration)
+        : decoder_pool_.Last(stream);
+    if (instance == nullptr) {
+        ESP_LOGE(TAG, "Audio decoder is not configured");
+        return nullptr;
+    }
+
+    auto task = std::make_unique<AudioTask>();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->pcm.resize(instance->frame_size);
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = source != nullptr ? (uint8_t *)(source->payload_data()) : nullptr,
+        .len = source != nullptr ? (uint32_t)(source->payload_size()) : 0,
+        .consumed = 0,
+        .frame_recover = conceal ? ESP_AUDIO_DEC_RECOVERY_PLC : ESP_AUDIO_DEC_RECOVERY_NONE,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)(task->pcm.data()),
+        .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    auto ret = esp_opus_dec_decode(instance->decoder, &raw, &out_frame, &dec_info);
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
+        return nullptr;
+    }
+
+    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
+    if (instance->resampler != nullptr) {
+        uint32_t target_size = 0;
+        esp_ae_rate_cvt_get_max_out_sample_num(instance->resampler, task->pcm.size(), &target_size);
+        output_resample_buffer_.resize(target_size);
+        uint32_t actual_output = target_size;
+        esp_ae_rate_cvt_process(instance->resampler, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
+                                (esp_ae_sample_t)output_resample_buffer_.data(), &actual_output);
+        task->pcm.assign(output_resample_buffer_.begin(), output_resample_buffer_.begin() + actual_output);
     }
     decoder_lock.unlock();
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-        return;
+    task->stage_time_us = esp_timer_get_time();
+    decode_worker_statistics_.Record(task->stage_time_us - start_time);
+    return task;
+}
+
+// Decoder task only, returns false if there is no sound to play
+bool AudioService::DecodeSoundFrame() {
+    if (PlayCachedSoundFrame()) {
+        return true;
     }
-    decoder_sample_rate_ = sample_rate;
-    decoder_duration_ms_ = frame_duration;
-    decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+    auto sound = NextSoundPacket();
+    if (sound == nullptr) {
+        /* A cached sound may have just started */
+        return PlayCachedSoundFrame();
+    }
+    auto task = DecodePacket(kAudioMixerChannelSound, sound.get(), false);
+    if (task == nullptr) {
+        sound_cache_.Abort();
+        return true;
+    }
+    sound_cache_.Append(task->pcm.data(), task->pcm.size());
+    if (sound_playback_queue_.Push(std::move(task))) {
+        xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_EMPTY);
+    }
+    return true;
+}
+
+void AudioService::OpusEncodeTask() {
+    while (true) {
+        if (service_stopped_) {
+            break;
+        }
+
+        /* Encode the audio to send queue */
+        std::unique_ptr<AudioTask> task;
+        if (audio_send_queue_.Full() || !audio_encode_queue_.Pop(task)) {
+            xEventGroupWaitBits(queue_event_group_, AS_QUEUE_ENCODE_NOT_EMPTY | AS_QUEUE_SEND_NOT_FULL,
+                pdTRUE, pdFALSE, portMAX_DELAY);
+            continue;
+        }
+        xEventGroupSetBits(queue_event_group_, AS_QUEUE_ENCODE_NOT_FULL);
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (decoder_sample_rate_ != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec->output_sample_rate());
-        if (output_resampler_ != nullptr) {
-            esp_ae_rate_cvt_close(output_resampler_);
-            output_resampler_ = nullptr;
+        /* The encoder may be reopened by SetEncoderProfile(), frames queued before that are dropped */
+        std::unique_lock<std::mutex> encoder_lock(encoder_mutex_);
+        if (opus_encoder_ == nullptr || task->pcm.size() != encoder_frame_size_) {
+            ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
+                     task->pcm.size(), encoder_frame_size_);
+            continue;
         }
-        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(
-            decoder_sample_rate_, codec->output_sample_rate(), ESP_AUDIO_MONO);
-        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &output_resampler_);
-        if (output_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+
+        auto packet = std::make_unique<AudioStreamPacket>();
+        packet->frame_duration = encoder_duration_ms_;
+        packet->sample_rate = encoder_sample_rate_;
+        packet->timestamp = task->timestamp;
+        packet->origin_time_us = task->origin_time_us;
+
+        int64_t start_time = esp_timer_get_time();
+        esp_audio_enc_in_frame_t in = {
+            .buffer = (uint8_t *)(task->pcm.data()),
+            .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
+        };
+        esp_audio_enc_out_frame_t out = {
+            .buffer = encoder_output_buffer_.data(),
+            .len = (uint32_t)encoder_output_buffer_.size(),
+            .encoded_bytes = 0,
+        };
+        auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
+        packet->stage_time_us = esp_timer_get_time();
+        encode_worker_statistics_.Record(packet->stage_time_us - start_time);
+        if (ret != ESP_AUDIO_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            continue;
+        }
+        // Copied behind the headroom, so the transport writes its header in front without moving the data
+        packet->AssignWithHeadroom(encoder_output_buffer_.data(), out.encoded_bytes);
+        encoder_lock.unlock();
+
+        if (task->type == kAudioTaskTypeEncodeToSendQueue) {
+            latency_tracer_.Record(kAudioLatencyEncode, task->stage_time_us, packet->stage_time_us);
+            audio_send_queue_.Push(std::move(packet));
+            if (callbacks_.on_send_queue_available) {
+                callbacks_.on_send_queue_available();
+            }
+        } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
+            if (!audio_testing_queue_.Push(std::move(packet))) {
+                ESP_LOGW(TAG, "Audio testing queue is full, dropping packet");
+            }
         }
+        debug_statistics_.encode_count++;
     }
+
+    ESP_LOGW(TAG, "Opus encode task stopped");
 }
 
 void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
     auto task = std::make_unique<AudioTask>();
     task->type = type;
     task->pcm = std::move(pcm);
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
-        }
-        timestamp_queue_.pop_front();
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->origin_time_us = last_capture_time_us_;
+        task->stage_time_us = esp_timer_get_time();
+        latency_tracer_.Record(kAudioLatencyProcess, task->origin_time_us, task->stage_time_us);
+
+#if CONFIG_USE_SERVER_AEC
+        /* The voice that was playing when the first sample of the frame was captured */
+        int64_t capture_start_time = task->origin_time_us - (int64_t)task->pcm.size() * 1000000 / encoder_sample_rate_;
+        task->timestamp = playout_tracker_.GetTimestamp(capture_start_time);
+#endif
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue */
+    std::lock_guard<std::mutex> lock(encode_producer_mutex_);
+    while (!audio_encode_queue_.Push(std::move(task))) {
+        if (service_stopped_) {
+            return;
+        }
+        xEventGroupWaitBits(queue_event_group_, AS_QUEUE_ENCODE_NOT_FULL, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_ENCODE_NOT_EMPTY);
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    while (audio_decode_queue_.Size() >= MAX_DECODE_PACKETS_IN_QUEUE || audio_decode_queue_.Full()) {
+        if (!wait || service_stopped_) {
             return false;
         }
+        xEventGroupWaitBits(queue_event_group_, AS_QUEUE_DECODE_NOT_FULL, pdTRUE, pdFALSE, portMAX_DELAY);
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
+    // Only a packet that is queued is numbered and timed, a dropped one must not show up as a gap to conceal
+    jitter_buffer_.OnArrival(*packet);
+    audio_decode_queue_.Push(std::move(packet));
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY);
     return true;
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
+    std::unique_ptr<AudioStreamPacket> packet;
+    if (!audio_send_queue_.Pop(packet)) {
         return nullptr;
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_SEND_NOT_FULL);
     return packet;
 }
 
+// Hand over every packet that is ready at once, the caller keeps the vector to reuse its capacity
+size_t AudioService::PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    size_t count = 0;
+    std::unique_ptr<AudioStreamPacket> packet;
+    while (audio_send_queue_.Pop(packet)) {
+        packets.push_back(std::move(packet));
+        count++;
+    }
+    // Also set after a pop that only reclaimed the slots discarded by ClearSendQueue()
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_SEND_NOT_FULL);
+    return count;
+}
+
+// Drop the packets that have not been sent yet, safe to call from any task
+void AudioService::ClearSendQueue() {
+    audio_send_queue_.Clear();
+    // Wake up the consumer, so it reclaims the discarded slots for the encoder
+    if (callbacks_.on_send_queue_available) {
+        callbacks_.on_send_queue_available();
+    }
+}
+
 void AudioService::EncodeWakeWord() {
     if (wake_word_) {
         wake_word_->EncodeWakeWordData();
@@ -539,11 +689,12 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
-    if (wake_word_->GetWakeWordOpus(packet->payload)) {
-        return packet;
+    if (!wake_word_->GetWakeWordOpus(wake_word_opus_)) {
+        return nullptr;
     }
-    return nullptr;
+    auto packet = std::make_unique<AudioStreamPacket>();
+    packet->AssignWithHeadroom(wake_word_opus_.data(), wake_word_opus_.size());
+    return packet;
 }
 
 void AudioService::EnableWakeWordDetection(bool enable) {
@@ -558,6 +709,7 @@ void AudioService::EnableWakeWordDetection(bool enable) {
                 ESP_LOGE(TAG, "Failed to initialize wake word");
                 return;
             }
+            wake_word_->SetEncoderProfile(GetEncoderProfile());
             wake_word_initialized_ = true;
         }
         // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
@@ -580,7 +732,7 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+            audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
             audio_processor_initialized_ = true;
         }
 
@@ -605,93 +757,331 @@ void AudioService::EnableVoiceProcessing(bool enable) {
 
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
+    /* The input task records and plays back the test, so audio_testing_queue_ keeps a single consumer */
     if (enable) {
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_STOP);
+    }
+}
+
+void AudioService::PlayAudioTestingPackets() {
+    /* Move audio_testing_queue_ to audio_decode_queue_ */
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    audio_decode_queue_.Clear();
+    std::unique_ptr<AudioStreamPacket> packet;
+    while (audio_testing_queue_.Pop(packet)) {
+        jitter_buffer_.OnArrival(*packet);
+        /* The decode task reclaims the slots discarded by Clear() on its next pop, wait for it instead of dropping */
+        while (!audio_decode_queue_.Push(std::move(packet))) {
+            if (service_stopped_) {
+                return;
+            }
+            xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY);
+            xEventGroupWaitBits(queue_event_group_, AS_QUEUE_DECODE_NOT_FULL, pdTRUE, pdFALSE, pdMS_TO_TICKS(20));
+        }
     }
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY);
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
     if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+        audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
         audio_processor_initialized_ = true;
     }
 
     audio_processor_->EnableDeviceAec(enable);
 }
 
+bool AudioService::CalibrateAecDelay(AecDelayEstimate& estimate) {
+    if (!codec_->input_reference()) {
+        estimate.error = "The codec has no reference channel";
+        return false;
+    }
+    if (aec_probe_pending_) {
+        estimate.error = "The calibration probe is still playing";
+        return false;
+    }
+    if (xEventGroupGetBits(event_group_) & AS_EVENT_AEC_CALIBRATION_RUNNING) {
+        estimate.error = "The previous recording has not stopped";
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Calibrating AEC delay");
+    power_governor_.Wake(kAudioPowerInput);
+    power_governor_.Wake(kAudioPowerOutput);
+    aec_estimator_.Start(codec_->input_channels(), 16000);
+    AecDelayEstimator::GenerateProbe(aec_probe_, codec_->output_sample_rate());
+    aec_probe_offset_ = 0;
+    aec_probe_pending_ = true;
+    xEventGroupClearBits(event_group_, AS_EVENT_AEC_CALIBRATION_DONE | AS_EVENT_AEC_CALIBRATION_STOP);
+    xEventGroupSetBits(event_group_, AS_EVENT_AEC_CALIBRATION_RUNNING);
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_EMPTY);
+
+    auto bits = xEventGroupWaitBits(event_group_, AS_EVENT_AEC_CALIBRATION_DONE, pdTRUE, pdFALSE,
+        pdMS_TO_TICKS(AEC_CALIBRATION_CAPTURE_MS * 3));
+    if ((bits & AS_EVENT_AEC_CALIBRATION_DONE) == 0) {
+        /* The input task owns the estimator until it acknowledges the stop, RUNNING stays set if it never does */
+        xEventGroupSetBits(event_group_, AS_EVENT_AEC_CALIBRATION_STOP);
+        xEventGroupWaitBits(event_group_, AS_EVENT_AEC_CALIBRATION_DONE, pdTRUE, pdFALSE,
+            pdMS_TO_TICKS(AEC_CALIBRATION_STOP_TIMEOUT_MS));
+        estimate.error = "Timed out recording the probe";
+        return false;
+    }
+    if (!aec_estimator_.Estimate(estimate)) {
+        ESP_LOGW(TAG, "AEC delay calibration failed: %s", estimate.error);
+        return false;
+    }
+
+    Settings settings("audio", true);
+    settings.SetInt("aec_ref_delay", estimate.reference_delay_samples);
+    audio_processor_->SetReferenceDelay(estimate.reference_delay_samples);
+    return true;
+}
+
+bool AudioService::StartAecDelayCalibration() {
+    if (aec_calibrating_.exchange(true)) {
+        return false;
+    }
+    xTaskCreate([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        AecDelayEstimate estimate;
+        bool success = audio_service->CalibrateAecDelay(estimate);
+        {
+            std::lock_guard<std::mutex> lock(audio_service->aec_calibration_mutex_);
+            audio_service->aec_calibration_result_ = estimate;
+            audio_service->aec_calibration_status_ = success ? "done" : "failed";
+        }
+        audio_service->aec_calibrating_ = false;
+        vTaskDelete(NULL);
+    }, "aec_calibration", AEC_CALIBRATION_TASK_STACK_SIZE, this, 2, nullptr);
+    return true;
+}
+
+cJSON* AudioService::GetAecCalibrationJson() {
+    std::lock_guard<std::mutex> lock(aec_calibration_mutex_);
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "status", aec_calibrating_ ? "running" : aec_calibration_status_);
+    if (aec_calibration_result_.error != nullptr) {
+        cJSON_AddStringToObject(json, "error", aec_calibration_result_.error);
+    }
+    cJSON_AddNumberToObject(json, "delay_samples", aec_calibration_result_.delay_samples);
+    cJSON_AddNumberToObject(json, "reference_delay_samples", aec_calibration_result_.reference_delay_samples);
+    cJSON_AddNumberToObject(json, "peak_ratio", aec_calibration_result_.peak_ratio);
+    return json;
+}
+
+void AudioService::PutAecProbeFrame() {
+    size_t frame_size = codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS;
+    size_t count = std::min(frame_size, aec_probe_.size() - aec_probe_offset_);
+    aec_probe_frame_.assign(aec_probe_.begin() + aec_probe_offset_, aec_probe_.begin() + aec_probe_offset_ + count);
+    mixer_.Put(kAudioMixerChannelSound, aec_probe_frame_);
+    aec_probe_offset_ += count;
+    if (aec_probe_offset_ >= aec_probe_.size()) {
+        aec_probe_ = std::vector<int16_t>();
+        aec_probe_pending_ = false;
+    }
+}
+
 void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
+bool AudioService::SetEncoderProfile(const OpusEncoderProfile& profile) {
+    if (profile.frame_duration_ms != 20 && profile.frame_duration_ms != 40 && profile.frame_duration_ms != 60) {
+        ESP_LOGE(TAG, "Unsupported encoder frame duration: %d", profile.frame_duration_ms);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    if (opus_encoder_ != nullptr && profile == encoder_profile_) {
+        return true;
+    }
+
+    /* Open the new encoder first, so a rejected profile keeps the current one working */
+    void* encoder = nullptr;
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG(profile);
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+    if (encoder == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return false;
+    }
+    if (opus_encoder_ != nullptr) {
+        esp_opus_enc_close(opus_encoder_);
+    }
+    opus_encoder_ = encoder;
+    encoder_profile_ = profile;
+    encoder_duration_ms_ = profile.frame_duration_ms;
+    esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
+    encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    encoder_output_buffer_.resize(encoder_outbuf_size_);
+
+    if (audio_processor_initialized_) {
+        audio_processor_->SetFrameDuration(encoder_duration_ms_);
+    }
+    if (wake_word_initialized_) {
+        wake_word_->SetEncoderProfile(profile);
+    }
+    ESP_LOGI(TAG, "Encoder profile: %d ms, bitrate %d, complexity %d, fec %d, dtx %d", profile.frame_duration_ms,
+        profile.bitrate, profile.complexity, profile.enable_fec, profile.enable_dtx);
+    return true;
+}
+
+OpusEncoderProfile AudioService::GetEncoderProfile() {
+    std::lock_guard<std::mutex> lock(encoder_mutex_);
+    return encoder_profile_;
+}
+
 void AudioService::PlaySound(const std::string_view& ogg) {
-    if (!codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-        codec_->EnableOutput(true);
+    power_governor_.Wake(kAudioPowerOutput);
+
+    /* The data stays where it is (flash or assets partition), the decoder task demuxes it as it goes */
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        if (sound_queue_.size() >= MAX_SOUNDS_IN_QUEUE) {
+            ESP_LOGW(TAG, "Too many sounds in queue, dropping one");
+            return;
+        }
+        sound_queue_.push_back(ogg);
     }
+    xEventGroupClearBits(queue_event_group_, AS_QUEUE_PLAYBACK_IDLE);
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY);
+}
 
-    const auto* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
+bool AudioService::IsSoundPending() {
+    std::lock_guard<std::mutex> lock(sound_mutex_);
+    return sound_playing_ || !sound_queue_.empty();
+}
 
-    auto demuxer = std::make_unique<OggDemuxer>();
-    demuxer->OnDemuxerFinished([this](const uint8_t* data, int sample_rate, size_t size){
-        auto packet = std::make_unique<AudioStreamPacket>();
-        packet->sample_rate = sample_rate;
-        packet->frame_duration = 60;
-        packet->payload.resize(size);
-        std::memcpy(packet->payload.data(), data, size);
-        PushPacketToDecodeQueue(std::move(packet), true);
-    });
-    demuxer->Reset();
-    demuxer->Process(buf, size);
+// Decoder task only
+std::unique_ptr<AudioStreamPacket> AudioService::NextSoundPacket() {
+    std::unique_lock<std::mutex> lock(sound_mutex_);
+    if (sound_discard_) {
+        sound_discard_ = false;
+        sound_packets_.clear();
+        sound_data_ = std::string_view();
+        sound_offset_ = 0;
+        sound_cached_ = nullptr;
+        sound_cache_.Abort();
+    }
+    if (sound_cached_ != nullptr) {
+        return nullptr;
+    }
+    while (sound_packets_.empty()) {
+        if (sound_offset_ >= sound_data_.size()) {
+            if (!sound_data_.empty()) {
+                /* The last packet of the sound has been decoded */
+                sound_data_ = std::string_view();
+                lock.unlock();
+                sound_cache_.Commit();
+                lock.lock();
+                continue;
+            }
+            if (sound_queue_.empty() || sound_discard_) {
+                sound_offset_ = 0;
+                sound_playing_ = !sound_queue_.empty();
+                return nullptr;
+            }
+            auto sound = sound_queue_.front();
+            sound_queue_.pop_front();
+            sound_playing_ = true;
+            sound_offset_ = 0;
+            if ((sound_cached_ = sound_cache_.Find(sound)) != nullptr) {
+                sound_cached_offset_ = 0;
+                return nullptr;
+            }
+            sound_data_ = sound;
+            sound_cache_.Begin(sound);
+            sound_demuxer_->Reset();
+            continue;
+        }
+        /* Only the decoder task touches the demuxer, so it runs without the lock */
+        size_t size = std::min<size_t>(SOUND_DEMUX_SLICE_SIZE, sound_data_.size() - sound_offset_);
+        auto data = reinterpret_cast<const uint8_t*>(sound_data_.data()) + sound_offset_;
+        sound_offset_ += size;
+        lock.unlock();
+        sound_demuxer_->Process(data, size);
+        lock.lock();
+        if (sound_discard_) {
+            return nullptr;
+        }
+    }
+    auto packet = std::move(sound_packets_.front());
+    sound_packets_.pop_front();
+    return packet;
+}
+
+// Decoder task only, plays one frame of a cached sound
+bool AudioService::PlayCachedSoundFrame() {
+    if (sound_cached_ == nullptr) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        if (sound_discard_) {
+            return false;
+        }
+    }
+
+    size_t frame_size = codec_->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS;
+    size_t samples = std::min(frame_size, sound_cached_->samples - sound_cached_offset_);
+    auto task = std::make_unique<AudioTask>();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->pcm.assign(sound_cached_->pcm + sound_cached_offset_, sound_cached_->pcm + sound_cached_offset_ + samples);
+    task->stage_time_us = esp_timer_get_time();
+    sound_cached_offset_ += samples;
+    if (sound_cached_offset_ >= sound_cached_->samples) {
+        sound_cached_ = nullptr;
+    }
+    if (sound_playback_queue_.Push(std::move(task))) {
+        xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_NOT_EMPTY);
+    }
+    return true;
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && jitter_buffer_.Empty() &&
+        audio_playback_queue_.Empty() && sound_playback_queue_.Empty() && audio_testing_queue_.Empty() &&
+        !IsSoundPending();
 }
 
 void AudioService::WaitForPlaybackQueueEmpty() {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    audio_queue_cv_.wait(lock, [this]() { 
-        return service_stopped_ || (audio_decode_queue_.empty() && audio_playback_queue_.empty()); 
-    });
+    while (!service_stopped_ && !(audio_decode_queue_.Empty() && jitter_buffer_.Empty() && audio_playback_queue_.Empty() &&
+        sound_playback_queue_.Empty() && !IsSoundPending())) {
+        xEventGroupWaitBits(queue_event_group_, AS_QUEUE_PLAYBACK_IDLE, pdTRUE, pdFALSE, portMAX_DELAY);
+    }
+}
+
+void AudioService::NotifyIfPlaybackIdle() {
+    if (audio_decode_queue_.Empty() && jitter_buffer_.Empty() && audio_playback_queue_.Empty() &&
+        sound_playback_queue_.Empty() && !IsSoundPending()) {
+        xEventGroupSetBits(queue_event_group_, AS_QUEUE_PLAYBACK_IDLE);
+    }
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_reset(opus_decoder_);
-    }
+    decoder_pool_.Reset(kAudioMixerChannelVoice);
     decoder_lock.unlock();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    playout_tracker_.Reset();
+    /* Local sounds have their own mixer channel and keep playing */
+    audio_decode_queue_.Clear();
+    jitter_buffer_.RequestReset();
+    audio_playback_queue_.Clear();
+    mixer_.RequestFlush(kAudioMixerChannelVoice);
+    audio_testing_queue_.Clear();
+    /* Let the consumers reclaim the discarded slots and the producers refill them */
+    xEventGroupSetBits(queue_event_group_, AS_QUEUE_DECODE_NOT_EMPTY | AS_QUEUE_DECODE_NOT_FULL |
+        AS_QUEUE_PLAYBACK_NOT_EMPTY | AS_QUEUE_PLAYBACK_NOT_FULL);
+    NotifyIfPlaybackIdle();
 }
 
-void AudioService::CheckAndUpdateAudioPowerState() {
-    auto now = std::chrono::steady_clock::now();
-    auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
-    auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
-    if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
-        codec_->EnableInput(false);
-    }
-    if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
-        codec_->EnableOutput(false);
-    }
-    if (!codec_->input_enabled() && !codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-    }
+void AudioService::AbortPlayback() {
+    ESP_LOGI(TAG, "Abort playback");
+    ResetDecoder();
+    playback_abort_epoch_++;
 }
 
 void AudioService::SetModelsList(srmodel_list_t* models_list) {
@@ -719,6 +1109,11 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
+        wake_word_->OnVadStateChange([this](bool speaking) {
+            if (speaking && callbacks_.on_wake_word_speech) {
+                callbacks_.on_wake_word_speech();
+            }
+        });
     }
 }
 
@@ -3,9 +3,10 @@
 
 #include <memory>
 #include <deque>
-#include <condition_variable>
+#include <string_view>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -24,16 +25,39 @@
 #include "wake_word.h"
 #include "protocol.h"
 #include "ogg_demuxer.h"
+#include "spsc_queue.h"
+#include "jitter_buffer.h"
+#include "audio_latency.h"
+#include "sound_cache.h"
+#include "audio_mixer.h"
+#include "opus_decoder_pool.h"
+#include "audio_power_governor.h"
+#include "playout_tracker.h"
+#include "aec_delay_estimator.h"
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
  * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and separate tasks for Opus Encoder and Opus Decoder,
+ * so a slow decode never delays the uplink (and vice versa). Their core and priority come from Kconfig.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
+ * The Opus Decoder reads the Decode Queue through a jitter buffer, which restores the packet order and
+ * conceals lost packets (Opus PLC / FEC) instead of playing them in arrival order.
  * 
+ * Local sounds (PlaySound) are queued as views of the OGG data and demuxed by the decoder task a slice
+ * at a time, so the caller never blocks and a long prompt only holds the next few packets in memory.
+ * They skip the jitter buffer and have their own Playback Queue. Short prompts are decoded once, later
+ * plays go from the PCM kept in sound_cache_ straight to that queue, without touching the decoder.
+ * The output task mixes the voice and sound channels (AudioMixer), the voice is ducked under a sound.
+ * ResetDecoder() only flushes the voice channel.
+ *
+ * Every queue is a lock-free SPSC ring with its own wakeup bits in queue_event_group_, so a task
+ * only wakes up for the queues it is waiting on. The encode and decode queues may be fed from
+ * more than one task, those producers are serialized by a producer-side mutex that the consumer
+ * never takes.
  */
 
 #define OPUS_FRAME_DURATION_MS 60
@@ -42,15 +66,41 @@
 #define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MAX_TESTING_PACKETS_IN_QUEUE (AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS)
+#define MAX_SOUNDS_IN_QUEUE 16
+// OGG bytes demuxed per step, a step yields about one 60ms packet
+#define SOUND_DEMUX_SLICE_SIZE 256
+#define AUDIO_TASK_POOL_SIZE 10
+#define AUDIO_TASK_PCM_POOL_SIZE 6
+#define AUDIO_TASK_PCM_MAX_CAPACITY 4096
+
+#define OPUS_ENCODE_TASK_STACK_SIZE (2048 * 12)
+#define OPUS_DECODE_TASK_STACK_SIZE (2048 * 8)
+#define AEC_CALIBRATION_TASK_STACK_SIZE 4096
+// How long a timed out calibration waits for the input task to let go of the recording
+#define AEC_CALIBRATION_STOP_TIMEOUT_MS 500
+// A negative core id (or one the chip does not have) means no affinity
+#define AS_TASK_CORE_ID(core) (((core) < 0 || (core) >= portNUM_PROCESSORS) ? tskNO_AFFINITY : (core))
 
-#define AUDIO_POWER_TIMEOUT_MS 15000
-#define AUDIO_POWER_CHECK_INTERVAL_MS 1000
 
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_AEC_CALIBRATION_RUNNING    (1 << 4)
+#define AS_EVENT_AEC_CALIBRATION_DONE       (1 << 5)
+#define AS_EVENT_AEC_CALIBRATION_STOP       (1 << 6)
+#define AS_EVENT_AUDIO_TESTING_STOP         (1 << 7)
+
+#define AS_QUEUE_ENCODE_NOT_EMPTY           (1 << 0)
+#define AS_QUEUE_ENCODE_NOT_FULL            (1 << 1)
+#define AS_QUEUE_DECODE_NOT_EMPTY           (1 << 2)
+#define AS_QUEUE_DECODE_NOT_FULL            (1 << 3)
+#define AS_QUEUE_SEND_NOT_FULL              (1 << 4)
+#define AS_QUEUE_PLAYBACK_NOT_EMPTY         (1 << 5)
+#define AS_QUEUE_PLAYBACK_NOT_FULL          (1 << 6)
+#define AS_QUEUE_PLAYBACK_IDLE              (1 << 7)
+#define AS_QUEUE_ALL_EVENTS                 (0xFF)
 
 #define AS_OPUS_GET_FRAME_DRU_ENUM(duration_ms)                   \
     ((duration_ms) == 5 ? ESP_OPUS_ENC_FRAME_DURATION_5_MS :      \
@@ -62,23 +112,45 @@
      (duration_ms) == 100 ? ESP_OPUS_ENC_FRAME_DURATION_100_MS :  \
      (duration_ms) == 120 ? ESP_OPUS_ENC_FRAME_DURATION_120_MS : -1)
 
-#define AS_OPUS_ENC_CONFIG() {                                                                                    \
+#define AS_OPUS_ENC_CONFIG(profile) {                                                                             \
         .sample_rate        = ESP_AUDIO_SAMPLE_RATE_16K,                                                          \
         .channel            = ESP_AUDIO_MONO,                                                                     \
         .bits_per_sample    = ESP_AUDIO_BIT16,                                                                    \
-        .bitrate            = ESP_OPUS_BITRATE_AUTO,                                                              \
-        .frame_duration     = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(OPUS_FRAME_DURATION_MS),  \
+        .bitrate            = (profile).bitrate > 0 ? (profile).bitrate : ESP_OPUS_BITRATE_AUTO,                  \
+        .frame_duration     = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM((profile).frame_duration_ms), \
         .application_mode   = ESP_OPUS_ENC_APPLICATION_AUDIO,                                                     \
-        .complexity         = 0,                                                                                  \
-        .enable_fec         = false,                                                                              \
-        .enable_dtx         = true,                                                                               \
+        .complexity         = (profile).complexity,                                                               \
+        .enable_fec         = (profile).enable_fec,                                                               \
+        .enable_dtx         = (profile).enable_dtx,                                                               \
         .enable_vbr         = true,                                                                               \
     }
 
+#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
+    (esp_ae_rate_cvt_cfg_t)                                  \
+    {                                                        \
+        .src_rate        = (uint32_t)(_src_rate),            \
+        .dest_rate       = (uint32_t)(_dest_rate),           \
+        .channel         = (uint8_t)(_channel),              \
+        .bits_per_sample = ESP_AUDIO_BIT16,                  \
+        .complexity      = 2,                                \
+        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
+    }
+
+#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
+    (esp_opus_dec_cfg_t)                                                                                  \
+    {                                                                                                     \
+        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
+        .channel        = ESP_AUDIO_MONO,                                                                 \
+        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
+        .self_delimited = false,                                                                          \
+    }
+
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
     std::function<void(bool)> on_vad_change;
+    // Speech heard while only the wake word engine is listening
+    std::function<void(void)> on_wake_word_speech;
     std::function<void(void)> on_audio_testing_queue_full;
 };
 
@@ -90,9 +162,20 @@ enum AudioTaskType {
 };
 
 struct AudioTask {
-    AudioTaskType type;
+    AudioTaskType type = kAudioTaskTypeEncodeToSendQueue;
     std::vector<int16_t> pcm;
-    uint32_t timestamp;
+    uint32_t timestamp = 0;
+    // Latency tracing (esp_timer time), 0 if not traced: capture or receive time, and when the last stage finished
+    int64_t origin_time_us = 0;
+    int64_t stage_time_us = 0;
+
+    AudioTask();
+    ~AudioTask();
+
+    // Tasks come from a small fixed slab, the pcm storage is recycled across tasks
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+    static void TrimPool();
 };
 
 struct DebugStatistics {
@@ -102,6 +185,24 @@ struct DebugStatistics {
     uint32_t playback_count = 0;
 };
 
+// Processing time of one codec worker, only written by the worker itself
+struct CodecWorkerStatistics {
+    uint32_t frame_count = 0;
+    uint32_t last_us = 0;
+    uint32_t max_us = 0;
+    uint64_t total_us = 0;
+
+    void Record(int64_t elapsed_us) {
+        last_us = (uint32_t)elapsed_us;
+        if (last_us > max_us) {
+            max_us = last_us;
+        }
+        total_us += last_us;
+        frame_count++;
+    }
+    uint32_t average_us() const { return frame_count > 0 ? (uint32_t)(total_us / frame_count) : 0; }
+};
+
 class AudioService {
 public:
     AudioService();
@@ -119,19 +220,35 @@ public:
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
     bool IsAfeWakeWord();
+    const CodecWorkerStatistics& encode_worker_statistics() const { return encode_worker_statistics_; }
+    const CodecWorkerStatistics& decode_worker_statistics() const { return decode_worker_statistics_; }
+    AudioLatencyTracer& latency_tracer() { return latency_tracer_; }
+    AudioPowerGovernor& power_governor() { return power_governor_; }
 
     void EnableWakeWordDetection(bool enable);
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
+    // Plays a probe and measures the reference channel delay, blocks for about AEC_CALIBRATION_CAPTURE_MS.
+    // The result is saved and applied to the audio processor feed.
+    bool CalibrateAecDelay(AecDelayEstimate& estimate);
+    // Runs CalibrateAecDelay() in a background task, returns false if one is already running
+    bool StartAecDelayCalibration();
+    cJSON* GetAecCalibrationJson();
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
+    bool SetEncoderProfile(const OpusEncoderProfile& profile);
+    OpusEncoderProfile GetEncoderProfile();
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
     std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
+    size_t PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
+    void ClearSendQueue();
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Barge-in: drops the voice stream, including the frame being written, within a few ms
+    void AbortPlayback();
     void SetModelsList(srmodel_list_t* models_list);
 
 private:
@@ -139,40 +256,82 @@ private:
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
+    // Each wake word packet is read here and copied behind the packet headroom
+    std::vector<uint8_t> wake_word_opus_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     void* opus_encoder_ = nullptr;
-    void* opus_decoder_ = nullptr;
+    // Guards decoder_pool_, the decoder task uses it and ResetDecoder() may be called from any task
     std::mutex decoder_mutex_;
+    OpusDecoderPool decoder_pool_;
+    std::mutex encoder_mutex_;
+    OpusEncoderProfile encoder_profile_;
     std::mutex input_resampler_mutex_;
     esp_ae_rate_cvt_handle_t input_resampler_ = nullptr;
-    esp_ae_rate_cvt_handle_t output_resampler_ = nullptr;
     
     // Encoder/Decoder state
     int encoder_sample_rate_ = 16000;
-    int encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
+    // Written under encoder_mutex_, read without it by the input task to size its reads
+    std::atomic<int> encoder_duration_ms_{OPUS_FRAME_DURATION_MS};
     int encoder_frame_size_ = 0;
     int encoder_outbuf_size_ = 0;
-    int decoder_sample_rate_ = 0;
-    int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-    int decoder_frame_size_ = 0;
+    // Scratch buffers reused for every frame instead of being allocated per call
+    std::vector<uint8_t> encoder_output_buffer_;
+    std::vector<int16_t> input_resample_buffer_;
+    std::vector<int16_t> output_resample_buffer_;
     DebugStatistics debug_statistics_;
+    CodecWorkerStatistics encode_worker_statistics_;
+    CodecWorkerStatistics decode_worker_statistics_;
+    AudioLatencyTracer latency_tracer_;
+    // When the newest microphone samples were read, the processor output ends with them
+    std::atomic<int64_t> last_capture_time_us_{0};
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
+    EventGroupHandle_t queue_event_group_;
 
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    std::mutex encode_producer_mutex_;
+    std::mutex decode_producer_mutex_;
+    // The decode queue also receives the audio testing loopback, so it is sized for that
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, MAX_TESTING_PACKETS_IN_QUEUE> audio_decode_queue_;
+    JitterBuffer jitter_buffer_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
+    SpscQueue<std::unique_ptr<AudioStreamPacket>, MAX_TESTING_PACKETS_IN_QUEUE> audio_testing_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_playback_queue_;
+    SpscQueue<std::unique_ptr<AudioTask>, MAX_PLAYBACK_TASKS_IN_QUEUE> sound_playback_queue_;
+    AudioMixer mixer_;
+    std::vector<int16_t> mixer_output_;
+    // Bumped by AbortPlayback(), the output task stops writing as soon as it sees a new value
+    std::atomic<uint32_t> playback_abort_epoch_{0};
+    // Local sounds: the queue is shared with PlaySound(), the rest belongs to the decoder task
+    std::mutex sound_mutex_;
+    std::deque<std::string_view> sound_queue_;
+    bool sound_playing_ = false;
+    bool sound_discard_ = false;
+    std::unique_ptr<OggDemuxer> sound_demuxer_;
+    std::string_view sound_data_;
+    size_t sound_offset_ = 0;
+    std::deque<std::unique_ptr<AudioStreamPacket>> sound_packets_;
+    SoundCache sound_cache_;
+    const SoundCacheEntry* sound_cached_ = nullptr;
+    size_t sound_cached_offset_ = 0;
     // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    PlayoutTracker playout_tracker_;
+    // AEC delay calibration: the estimator belongs to the input task while it runs, the probe to the output task
+    AecDelayEstimator aec_estimator_;
+    std::vector<int16_t> aec_probe_;
+    std::vector<int16_t> aec_probe_frame_;
+    size_t aec_probe_offset_ = 0;
+    std::atomic<bool> aec_probe_pending_{false};
+    std::atomic<bool> aec_calibrating_{false};
+    std::mutex aec_calibration_mutex_;
+    AecDelayEstimate aec_calibration_result_;
+    const char* aec_calibration_status_ = "none";
 
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
@@ -180,16 +339,21 @@ private:
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
 
-    esp_timer_handle_t audio_power_timer_ = nullptr;
-    std::chrono::steady_clock::time_point last_input_time_;
-    std::chrono::steady_clock::time_point last_output_time_;
+    AudioPowerGovernor power_governor_;
 
     void AudioInputTask();
     void AudioOutputTask();
-    void OpusCodecTask();
+    void OpusEncodeTask();
+    void OpusDecodeTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
-    void SetDecodeSampleRate(int sample_rate, int frame_duration);
-    void CheckAndUpdateAudioPowerState();
+    void NotifyIfPlaybackIdle();
+    void PutAecProbeFrame();
+    void PlayAudioTestingPackets();
+    bool IsSoundPending();
+    std::unique_ptr<AudioStreamPacket> NextSoundPacket();
+    bool PlayCachedSoundFrame();
+    bool DecodeSoundFrame();
+    std::unique_ptr<AudioTask> DecodePacket(AudioMixerChannel stream, const AudioStreamPacket* source, bool conceal);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,111 @@
+#ifndef CHUNK_RING_BUFFER_H
+#define CHUNK_RING_BUFFER_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "pcm_kernels.h"
+
+#define CHUNK_RING_BUFFER_CHUNKS 4
+
+/*
+ * Staging buffer between the 10 ms input frames and the chunk size of a speech engine (AFE, WakeNet, MultiNet).
+ *
+ * The capacity is a multiple of the chunk size and chunks are only ever taken from a chunk boundary, so every
+ * chunk is contiguous and can be handed to the engine in place. Nothing is moved or allocated after Resize().
+ * If the engine falls behind by more than the capacity, the oldest chunks are dropped.
+ * Not thread safe, the owners call it with their input lock held.
+ */
+class ChunkRingBuffer {
+public:
+    // Only allocates when the chunk size changes, the buffered samples are dropped
+    void Resize(size_t chunk_size) {
+        if (chunk_size == chunk_size_) {
+            return;
+        }
+        chunk_size_ = chunk_size;
+        buffer_.assign(chunk_size * CHUNK_RING_BUFFER_CHUNKS, 0);
+        Clear();
+    }
+
+    // Writes before the first Resize() are dropped
+    void Write(const int16_t* data, size_t samples) {
+        if (chunk_size_ == 0) {
+            return;
+        }
+        while (samples > 0) {
+            size_t count = Reserve(samples);
+            memcpy(buffer_.data() + write_position_, data, count * sizeof(int16_t));
+            Commit(count);
+            data += count;
+            samples -= count;
+        }
+    }
+
+    // Write one channel of interleaved frames
+    void WriteChannel(const int16_t* data, size_t frames, int channels, int channel) {
+        if (chunk_size_ == 0) {
+            return;
+        }
+        while (frames > 0) {
+            size_t count = Reserve(frames);
+            PcmExtractChannel(data, buffer_.data() + write_position_, count, channels, channel);
+            Commit(count);
+            data += count * channels;
+            frames -= count;
+        }
+    }
+
+    // The oldest full chunk, or nullptr. It stays valid until PopChunk() or the next write.
+    const int16_t* PeekChunk() const {
+        return size_ >= chunk_size_ && chunk_size_ > 0 ? buffer_.data() + read_position_ : nullptr;
+    }
+
+    void PopChunk() {
+        read_position_ = (read_position_ + chunk_size_) % buffer_.size();
+        size_ -= chunk_size_;
+    }
+
+    void Clear() {
+        read_position_ = 0;
+        write_position_ = 0;
+        size_ = 0;
+    }
+
+    size_t chunk_size() const { return chunk_size_; }
+    size_t size() const { return size_; }
+    // Chunks overwritten because the reader fell behind, since the buffer was created
+    size_t dropped_chunks() const { return dropped_chunks_; }
+
+private:
+    std::vector<int16_t> buffer_;
+    size_t chunk_size_ = 0;
+    size_t read_position_ = 0;
+    size_t write_position_ = 0;
+    size_t size_ = 0;
+    size_t dropped_chunks_ = 0;
+
+    // Number of samples that can be written contiguously at the write position, up to the wanted count
+    size_t Reserve(size_t wanted) {
+        if (size_ == buffer_.size()) {
+            PopChunk();
+            dropped_chunks_++;
+        }
+        size_t count = std::min(wanted, buffer_.size() - write_position_);
+        size_t free = buffer_.size() - size_;
+        if (count > free) {
+            count = free;
+        }
+        return count;
+    }
+
+    void Commit(size_t count) {
+        write_position_ = (write_position_ + count) % buffer_.size();
+        size_ += count;
+    }
+};
+
+#endif // CHUNK_RING_BUFFER_H
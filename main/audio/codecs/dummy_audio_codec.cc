@@ -1,20 +1,98 @@
 #include "dummy_audio_codec.h"
 
-DummyAudioCodec::DummyAudioCodec(int input_sample_rate, int output_sample_rate) {
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "DummyAudioCodec"
+
+DummyAudioCodec::DummyAudioCodec(int input_sample_rate, int output_sample_rate, std::string_view input_wav) {
     duplex_ = true;
     input_reference_ = false;
     input_channels_ = 1;
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
+
+    if (!input_wav.empty()) {
+        input_pcm_ = FindWavData(input_wav);
+    }
 }
 
 DummyAudioCodec::~DummyAudioCodec() {
 }
 
+std::string_view DummyAudioCodec::FindWavData(std::string_view wav) {
+    if (wav.size() < 12 || wav.substr(0, 4) != "RIFF" || wav.substr(8, 4) != "WAVE") {
+        ESP_LOGE(TAG, "Input clip is not a WAV file");
+        return std::string_view();
+    }
+
+    bool format_ok = false;
+    size_t offset = 12;
+    while (offset + 8 <= wav.size()) {
+        auto id = wav.substr(offset, 4);
+        uint32_t size;
+        memcpy(&size, wav.data() + offset + 4, sizeof(size));
+        size_t data_offset = offset + 8;
+        size = std::min<size_t>(size, wav.size() - data_offset);
+
+        if (id == "fmt " && size >= 16) {
+            uint16_t format, channels, bits_per_sample;
+            uint32_t sample_rate;
+            memcpy(&format, wav.data() + data_offset, sizeof(format));
+            memcpy(&channels, wav.data() + data_offset + 2, sizeof(channels));
+            memcpy(&sample_rate, wav.data() + data_offset + 4, sizeof(sample_rate));
+            memcpy(&bits_per_sample, wav.data() + data_offset + 14, sizeof(bits_per_sample));
+            format_ok = format == 1 && channels == 1 && bits_per_sample == 16 && (int)sample_rate == input_sample_rate_;
+            if (!format_ok) {
+                ESP_LOGE(TAG, "Input clip must be 16-bit mono PCM at %d Hz, got format %u, %u channels, %u bits, %lu Hz",
+                    input_sample_rate_, format, channels, bits_per_sample, sample_rate);
+                return std::string_view();
+            }
+        } else if (id == "data" && format_ok) {
+            ESP_LOGI(TAG, "Input clip: %u ms", (unsigned)(size / sizeof(int16_t) * 1000 / input_sample_rate_));
+            return wav.substr(data_offset, size & ~(size_t)1);
+        }
+        // Chunks are padded to an even size
+        offset = data_offset + size + (size & 1);
+    }
+    ESP_LOGE(TAG, "Input clip has no PCM data");
+    return std::string_view();
+}
+
+// Block until the samples would have gone through the I2S DMA
+void DummyAudioCodec::WaitForSampleClock(int64_t& clock_us, int samples, int sample_rate) {
+    int64_t now_us = esp_timer_get_time();
+    if (clock_us < now_us - DUMMY_AUDIO_CODEC_MAX_LAG_US) {
+        clock_us = now_us;
+    }
+    clock_us += (int64_t)samples * 1000000 / sample_rate;
+    if (clock_us > now_us) {
+        vTaskDelay(pdMS_TO_TICKS((clock_us - now_us) / 1000));
+    }
+}
+
 int DummyAudioCodec::Read(int16_t* dest, int samples) {
-    return 0;
+    WaitForSampleClock(input_clock_us_, samples, input_sample_rate_);
+
+    size_t total = input_pcm_.size() / sizeof(int16_t);
+    if (total == 0) {
+        memset(dest, 0, samples * sizeof(int16_t));
+        return samples;
+    }
+    // The clip may be embedded at any alignment, so it is copied as bytes
+    for (int i = 0; i < samples;) {
+        size_t count = std::min<size_t>(samples - i, total - input_position_);
+        memcpy(dest + i, input_pcm_.data() + input_position_ * sizeof(int16_t), count * sizeof(int16_t));
+        i += count;
+        input_position_ = (input_position_ + count) % total;
+    }
+    return samples;
 }
 
 int DummyAudioCodec::Write(const int16_t* data, int samples) {
-    return 0;
+    WaitForSampleClock(output_clock_us_, samples, output_sample_rate_);
+    return samples;
 }
@@ -3,14 +3,33 @@
 
 #include "audio_codec.h"
 
+#include <string_view>
+#include <cstdint>
+
+// Sample clocks that fell further behind than this (e.g. while the channel was disabled) restart from now
+#define DUMMY_AUDIO_CODEC_MAX_LAG_US 100000
+
+/*
+ * A codec without hardware for running the audio pipeline on a bare board, e.g. to benchmark it.
+ * Read() and Write() block like I2S DMA does, so the pipeline runs in real time. The input plays
+ * the given WAV clip (16-bit PCM, mono, at the input sample rate) in a loop, or silence without
+ * one. The output is discarded.
+ */
 class DummyAudioCodec : public AudioCodec {
 private:
+    std::string_view input_pcm_;
+    size_t input_position_ = 0;
+    int64_t input_clock_us_ = 0;
+    int64_t output_clock_us_ = 0;
+
     virtual int Read(int16_t* dest, int samples) override;
     virtual int Write(const int16_t* data, int samples) override;
+    void WaitForSampleClock(int64_t& clock_us, int samples, int sample_rate);
+    std::string_view FindWavData(std::string_view wav);
 
 public:
-    DummyAudioCodec(int input_sample_rate, int output_sample_rate);
+    DummyAudioCodec(int input_sample_rate, int output_sample_rate, std::string_view input_wav = std::string_view());
     virtual ~DummyAudioCodec();
 };
 
-#endif // _DUMMY_AUDIO_CODEC_H
\ No newline at end of file
+#endif // _DUMMY_AUDIO_CODEC_H
@@ -0,0 +1,211 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "JitterBuffer"
+
+static inline int64_t NowMs() {
+    return esp_timer_get_time() / 1000;
+}
+
+void JitterBuffer::OnArrival(AudioStreamPacket& packet) {
+    if (arrival_reset_requested_.exchange(false)) {
+        arrival_started_ = false;
+        target_depth_ = JITTER_BUFFER_MIN_DEPTH;
+    }
+    if (packet.sequence == 0) {
+        packet.sequence = last_sequence_ + 1;
+    }
+    if (!arrival_started_ || (int32_t)(packet.sequence - last_sequence_) > 0) {
+        last_sequence_ = packet.sequence;
+    }
+
+    int frame_duration_ms = packet.frame_duration > 0 ? packet.frame_duration : JITTER_BUFFER_DEFAULT_FRAME_DURATION_MS;
+    int64_t now_ms = NowMs();
+    if (!arrival_started_) {
+        arrival_started_ = true;
+        first_sequence_ = packet.sequence;
+        first_arrival_ms_ = now_ms;
+        base_delay_ms_ = 0;
+        jitter_ms_ = 0;
+        return;
+    }
+
+    /*
+     * Delay of this packet compared to where its sequence number says it should be.
+     * The lowest delay seen is the reference, so a server that sends ahead of realtime
+     * measures as zero jitter. A delay larger than we would ever buffer is a pause
+     * between sentences, not jitter, and starts a new reference.
+     */
+    int64_t media_ms = (int64_t)(int32_t)(packet.sequence - first_sequence_) * frame_duration_ms;
+    int64_t delay_ms = (now_ms - first_arrival_ms_) - media_ms;
+    int64_t lateness_ms = delay_ms - base_delay_ms_;
+    if (lateness_ms < 0 || lateness_ms > JITTER_BUFFER_MAX_DEPTH * frame_duration_ms) {
+        base_delay_ms_ = delay_ms;
+        lateness_ms = 0;
+    }
+
+    // Grow at once, shrink slowly
+    if (lateness_ms > jitter_ms_) {
+        jitter_ms_ = lateness_ms;
+    } else {
+        jitter_ms_ = (jitter_ms_ * 31 + lateness_ms) / 32;
+    }
+
+    uint32_t depth = JITTER_BUFFER_MIN_DEPTH + (jitter_ms_ + frame_duration_ms - 1) / frame_duration_ms;
+    if (depth > JITTER_BUFFER_MAX_DEPTH) {
+        depth = JITTER_BUFFER_MAX_DEPTH;
+    }
+    if (depth != target_depth_) {
+        ESP_LOGD(TAG, "Target depth %lu -> %lu (jitter %lld ms)", target_depth_.load(), depth, jitter_ms_);
+        target_depth_ = depth;
+    }
+}
+
+bool JitterBuffer::Put(std::unique_ptr<AudioStreamPacket> packet) {
+    if (reset_requested_.exchange(false)) {
+        Reset();
+    }
+    uint32_t sequence = packet->sequence;
+    if (!synced_) {
+        synced_ = true;
+        next_sequence_ = sequence;
+    }
+
+    int32_t offset = (int32_t)(sequence - next_sequence_);
+    if (offset < 0) {
+        if (offset > -JITTER_BUFFER_CAPACITY) {
+            statistics_.late_count++;
+            return false;
+        }
+        // Far behind what we are playing, the sender has started a new stream
+        Flush();
+        next_sequence_ = sequence;
+        offset = 0;
+    } else if (offset >= JITTER_BUFFER_CAPACITY) {
+        // Too far ahead to keep the gap in the window, everything before it is given up
+        statistics_.lost_count += offset - (int32_t)count_.load();
+        Flush();
+        next_sequence_ = sequence;
+        offset = 0;
+    }
+
+    auto& slot = Slot(sequence);
+    if (slot) {
+        statistics_.duplicate_count++;
+        return false;
+    }
+    if (packet->frame_duration > 0) {
+        frame_duration_ms_ = packet->frame_duration;
+    }
+    arrival_ms_[sequence % JITTER_BUFFER_CAPACITY] = NowMs();
+    slot = std::move(packet);
+    count_++;
+    return true;
+}
+
+JitterBufferFrame JitterBuffer::Get() {
+    if (reset_requested_.exchange(false)) {
+        Reset();
+    }
+    JitterBufferFrame frame;
+    if (count_ == 0) {
+        prebuffering_ = true;
+        return frame;
+    }
+
+    int64_t now_ms = NowMs();
+    uint32_t depth = target_depth_;
+    int64_t patience_ms = (int64_t)depth * frame_duration_ms_;
+
+    /* After an underrun, wait until the target depth is buffered (or would have been) */
+    if (prebuffering_) {
+        int64_t oldest_ms = now_ms;
+        for (size_t i = 0; i < JITTER_BUFFER_CAPACITY; i++) {
+            if (slots_[i] && arrival_ms_[i] < oldest_ms) {
+                oldest_ms = arrival_ms_[i];
+            }
+        }
+        int64_t waited_ms = now_ms - oldest_ms;
+        int64_t prebuffer_ms = patience_ms - frame_duration_ms_;
+        if (count_ < depth && waited_ms < prebuffer_ms) {
+            frame.wait_ms = prebuffer_ms - waited_ms;
+            return frame;
+        }
+        prebuffering_ = false;
+    }
+
+    if (Slot(next_sequence_)) {
+        frame.type = kJitterBufferFramePacket;
+        frame.packet = Take(next_sequence_++);
+        hole_since_ms_ = -1;
+        return frame;
+    }
+
+    /* There is a gap before the next packet that has arrived */
+    uint32_t gap = 1;
+    while (!Slot(next_sequence_ + gap)) {
+        gap++;
+    }
+    uint32_t hole_end = next_sequence_ + gap;
+    if (hole_since_ms_ < 0 || hole_end_sequence_ != hole_end) {
+        hole_end_sequence_ = hole_end;
+        hole_since_ms_ = now_ms;
+    }
+    int64_t waited_ms = now_ms - hole_since_ms_;
+    if (count_ <= depth && waited_ms < patience_ms) {
+        frame.wait_ms = patience_ms - waited_ms;
+        return frame;
+    }
+
+    if (gap > JITTER_BUFFER_MAX_CONCEAL_FRAMES) {
+        // Too long to conceal without artifacts, skip to the next packet
+        ESP_LOGW(TAG, "Skipping %lu lost packets", gap);
+        statistics_.lost_count += gap;
+        next_sequence_ = hole_end;
+        frame.type = kJitterBufferFramePacket;
+        frame.packet = Take(next_sequence_++);
+        hole_since_ms_ = -1;
+        return frame;
+    }
+
+    statistics_.lost_count++;
+    statistics_.concealed_count++;
+    next_sequence_++;
+    frame.type = kJitterBufferFrameLost;
+    if (gap == 1) {
+        frame.fec_packet = Slot(next_sequence_).get();
+    }
+    return frame;
+}
+
+void JitterBuffer::RequestReset() {
+    arrival_reset_requested_ = true;
+    reset_requested_ = true;
+}
+
+void JitterBuffer::Reset() {
+    if (statistics_.lost_count > 0 || statistics_.late_count > 0) {
+        ESP_LOGI(TAG, "Lost %lu (concealed %lu), late %lu, duplicate %lu, target depth %lu",
+            statistics_.lost_count, statistics_.concealed_count, statistics_.late_count,
+            statistics_.duplicate_count, target_depth_.load());
+    }
+    statistics_ = JitterBufferStatistics();
+    Flush();
+    synced_ = false;
+    prebuffering_ = true;
+    hole_since_ms_ = -1;
+}
+
+std::unique_ptr<AudioStreamPacket> JitterBuffer::Take(uint32_t sequence) {
+    count_--;
+    return std::move(Slot(sequence));
+}
+
+void JitterBuffer::Flush() {
+    for (auto& slot : slots_) {
+        slot.reset();
+    }
+    count_ = 0;
+}
@@ -0,0 +1,91 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#include "protocol.h"
+
+#define JITTER_BUFFER_CAPACITY 16
+#define JITTER_BUFFER_MIN_DEPTH 1
+#define JITTER_BUFFER_MAX_DEPTH 8
+#define JITTER_BUFFER_MAX_CONCEAL_FRAMES 3
+#define JITTER_BUFFER_DEFAULT_FRAME_DURATION_MS 60
+
+enum JitterBufferFrameType {
+    kJitterBufferFrameNone,     // Nothing to play yet
+    kJitterBufferFramePacket,   // A packet in sequence
+    kJitterBufferFrameLost,     // A missing packet that has to be concealed
+};
+
+struct JitterBufferFrame {
+    JitterBufferFrameType type = kJitterBufferFrameNone;
+    std::unique_ptr<AudioStreamPacket> packet;
+    // For a lost frame, the packet right after the gap if it has arrived. Opus can rebuild the lost
+    // frame from its in-band FEC data. It stays in the buffer and is played next.
+    const AudioStreamPacket* fec_packet = nullptr;
+    // For kJitterBufferFrameNone, how long to wait before asking again (0 means until a packet arrives)
+    uint32_t wait_ms = 0;
+};
+
+struct JitterBufferStatistics {
+    uint32_t late_count = 0;
+    uint32_t duplicate_count = 0;
+    uint32_t lost_count = 0;
+    uint32_t concealed_count = 0;
+    uint32_t underrun_count = 0;
+};
+
+/*
+ * Reorders incoming audio packets by sequence number and decides when a gap is treated as lost.
+ *
+ * OnArrival() runs on the producer side (network task) and estimates the arrival jitter, which sets
+ * the target depth. Put() / Get() run on the decoder task only. RequestReset() may be called from any
+ * task, each side drops its state the next time it runs.
+ * Packets without a sequence number (e.g. websocket, audio testing) are numbered in arrival order.
+ */
+class JitterBuffer {
+public:
+    void OnArrival(AudioStreamPacket& packet);
+    bool Put(std::unique_ptr<AudioStreamPacket> packet);
+    JitterBufferFrame Get();
+    void RequestReset();
+
+    bool Full() const { return count_ >= JITTER_BUFFER_CAPACITY; }
+    bool Empty() const { return count_ == 0; }
+    uint32_t target_depth() const { return target_depth_; }
+    const JitterBufferStatistics& statistics() const { return statistics_; }
+
+private:
+    // Producer side
+    uint32_t last_sequence_ = 0;
+    bool arrival_started_ = false;
+    uint32_t first_sequence_ = 0;
+    int64_t first_arrival_ms_ = 0;
+    int64_t base_delay_ms_ = 0;
+    int64_t jitter_ms_ = 0;
+    std::atomic<uint32_t> target_depth_{JITTER_BUFFER_MIN_DEPTH};
+    std::atomic<bool> arrival_reset_requested_{false};
+
+    // Consumer side
+    std::array<std::unique_ptr<AudioStreamPacket>, JITTER_BUFFER_CAPACITY> slots_;
+    std::array<int64_t, JITTER_BUFFER_CAPACITY> arrival_ms_ = {};
+    std::atomic<size_t> count_{0};
+    uint32_t next_sequence_ = 0;
+    bool synced_ = false;
+    bool prebuffering_ = true;
+    uint32_t hole_end_sequence_ = 0;
+    int64_t hole_since_ms_ = -1;
+    int frame_duration_ms_ = JITTER_BUFFER_DEFAULT_FRAME_DURATION_MS;
+    JitterBufferStatistics statistics_;
+    std::atomic<bool> reset_requested_{false};
+
+    void Reset();
+    std::unique_ptr<AudioStreamPacket>& Slot(uint32_t sequence) { return slots_[sequence % JITTER_BUFFER_CAPACITY]; }
+    std::unique_ptr<AudioStreamPacket> Take(uint32_t sequence);
+    void Flush();
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,107 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+/*
+ * Fixed-capacity slab for objects of type T.
+ * The slab is carved out once, Allocate() falls back to the heap when it runs dry
+ * so a burst never fails, it just stops being allocation-free.
+ */
+template <typename T, size_t N>
+class MemoryPool {
+public:
+    MemoryPool() {
+        for (size_t i = 0; i < N; i++) {
+            free_list_[i] = &storage_[i * sizeof(T)];
+        }
+        free_count_ = N;
+    }
+    MemoryPool(const MemoryPool&) = delete;
+    MemoryPool& operator=(const MemoryPool&) = delete;
+
+    void* Allocate() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_count_ > 0) {
+                return free_list_[--free_count_];
+            }
+            fallback_count_++;
+        }
+        return ::operator new(sizeof(T));
+    }
+
+    void Free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        auto p = static_cast<uint8_t*>(ptr);
+        if (p >= storage_ && p < storage_ + sizeof(storage_)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_list_[free_count_++] = ptr;
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+    size_t available() const { return free_count_; }
+    size_t fallback_count() const { return fallback_count_; }
+
+private:
+    std::mutex mutex_;
+    alignas(T) uint8_t storage_[sizeof(T) * N];
+    void* free_list_[N];
+    size_t free_count_ = 0;
+    size_t fallback_count_ = 0;
+};
+
+/*
+ * Keeps up to N emptied buffers (std::vector like) around so their capacity can be reused.
+ * Buffers larger than max_capacity are released instead of being kept.
+ */
+template <typename Buffer, size_t N>
+class BufferPool {
+public:
+    explicit BufferPool(size_t max_capacity) : max_capacity_(max_capacity) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer Take() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (count_ == 0) {
+            return Buffer();
+        }
+        return std::move(buffers_[--count_]);
+    }
+
+    void Recycle(Buffer& buffer) {
+        if (buffer.capacity() == 0 || buffer.capacity() > max_capacity_) {
+            return;
+        }
+        buffer.clear();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (count_ < N) {
+            buffers_[count_++] = std::move(buffer);
+        }
+    }
+
+    // Release every kept buffer, used when the audio path goes idle
+    void Trim() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (count_ > 0) {
+            Buffer().swap(buffers_[--count_]);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    size_t max_capacity_;
+    Buffer buffers_[N];
+    size_t count_ = 0;
+};
+
+#endif // MEMORY_POOL_H
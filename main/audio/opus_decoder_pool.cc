@@ -0,0 +1,91 @@
+#include "opus_decoder_pool.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderPool"
+
+OpusDecoderPool::~OpusDecoderPool() {
+    Clear();
+}
+
+void OpusDecoderPool::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+}
+
+OpusDecoderInstance* OpusDecoderPool::Get(int stream, int sample_rate, int frame_duration_ms) {
+    OpusDecoderInstance* victim = &instances_[0];
+    for (auto& instance : instances_) {
+        if (instance.decoder != nullptr && instance.stream == stream && instance.sample_rate == sample_rate &&
+            instance.frame_duration_ms == frame_duration_ms) {
+            instance.last_used = ++use_counter_;
+            return &instance;
+        }
+        // An empty slot first, then the least recently used one
+        if (victim->decoder != nullptr && (instance.decoder == nullptr || instance.last_used < victim->last_used)) {
+            victim = &instance;
+        }
+    }
+
+    if (victim->decoder != nullptr) {
+        ESP_LOGI(TAG, "Closing decoder %d Hz %d ms (stream %d)", victim->sample_rate, victim->frame_duration_ms,
+            victim->stream);
+        Close(*victim);
+    }
+
+    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration_ms);
+    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &victim->decoder);
+    if (victim->decoder == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+        return nullptr;
+    }
+    if (sample_rate != output_sample_rate_) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, output_sample_rate_);
+        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(sample_rate, output_sample_rate_, ESP_AUDIO_MONO);
+        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &victim->resampler);
+        if (victim->resampler == nullptr) {
+            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+        }
+    }
+    victim->stream = stream;
+    victim->sample_rate = sample_rate;
+    victim->frame_duration_ms = frame_duration_ms;
+    victim->frame_size = sample_rate / 1000 * frame_duration_ms;
+    victim->last_used = ++use_counter_;
+    return victim;
+}
+
+OpusDecoderInstance* OpusDecoderPool::Last(int stream) {
+    OpusDecoderInstance* last = nullptr;
+    for (auto& instance : instances_) {
+        if (instance.decoder != nullptr && instance.stream == stream &&
+            (last == nullptr || instance.last_used > last->last_used)) {
+            last = &instance;
+        }
+    }
+    return last;
+}
+
+void OpusDecoderPool::Reset(int stream) {
+    for (auto& instance : instances_) {
+        if (instance.decoder != nullptr && instance.stream == stream) {
+            esp_opus_dec_reset(instance.decoder);
+        }
+    }
+}
+
+void OpusDecoderPool::Clear() {
+    for (auto& instance : instances_) {
+        Close(instance);
+    }
+}
+
+void OpusDecoderPool::Close(OpusDecoderInstance& instance) {
+    if (instance.decoder != nullptr) {
+        esp_opus_dec_close(instance.decoder);
+    }
+    if (instance.resampler != nullptr) {
+        esp_ae_rate_cvt_close(instance.resampler);
+    }
+    instance = OpusDecoderInstance();
+}
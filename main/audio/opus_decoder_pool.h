@@ -0,0 +1,51 @@
+#ifndef OPUS_DECODER_POOL_H
+#define OPUS_DECODER_POOL_H
+
+#include <array>
+#include <cstdint>
+#include "esp_ae_rate_cvt.h"
+
+// The voice stream, local sounds, and one spare for a server that switches formats
+#define OPUS_DECODER_POOL_SIZE 3
+
+struct OpusDecoderInstance {
+    void* decoder = nullptr;
+    // Only when the sample rate differs from the output
+    esp_ae_rate_cvt_handle_t resampler = nullptr;
+    int stream = -1;
+    int sample_rate = 0;
+    int frame_duration_ms = 0;
+    int frame_size = 0;
+    uint32_t last_used = 0;
+};
+
+/*
+ * Opus decoders and their output resamplers, kept open per stream and format.
+ *
+ * Local prompts (usually 16 kHz) and server TTS (often 24 kHz) interleave all the time, and each stream
+ * needs its own decoder state anyway. A format switch finds its instance here instead of closing and
+ * reopening one. Instances are opened on first use, the least recently used one is closed when the pool is full.
+ * Not thread safe, the owner serializes the calls.
+ */
+class OpusDecoderPool {
+public:
+    ~OpusDecoderPool();
+
+    void Initialize(int output_sample_rate);
+    // Returns nullptr if the decoder cannot be opened
+    OpusDecoderInstance* Get(int stream, int sample_rate, int frame_duration_ms);
+    // The instance the stream used last, for concealing a lost frame
+    OpusDecoderInstance* Last(int stream);
+    // Drop the decoder history of a stream, e.g. when a new answer starts
+    void Reset(int stream);
+    void Clear();
+
+private:
+    std::array<OpusDecoderInstance, OPUS_DECODER_POOL_SIZE> instances_;
+    int output_sample_rate_ = 0;
+    uint32_t use_counter_ = 0;
+
+    void Close(OpusDecoderInstance& instance);
+};
+
+#endif // OPUS_DECODER_POOL_H
@@ -0,0 +1,106 @@
+#include "pcm_kernels.h"
+
+#include <algorithm>
+
+static inline int16_t Saturate16(int32_t value) {
+    return (int16_t)std::clamp<int32_t>(value, -INT16_MAX, INT16_MAX);
+}
+
+void PcmExtractChannel(const int16_t* src, int16_t* dest, size_t frames, int channels, int channel) {
+    src += channel;
+    size_t i = 0;
+    if (channels == 2) {
+        // All four samples are loaded before any is stored, so this is also safe in place
+        for (; i + 4 <= frames; i += 4) {
+            int16_t s0 = src[2 * i];
+            int16_t s1 = src[2 * i + 2];
+            int16_t s2 = src[2 * i + 4];
+            int16_t s3 = src[2 * i + 6];
+            dest[i] = s0;
+            dest[i + 1] = s1;
+            dest[i + 2] = s2;
+            dest[i + 3] = s3;
+        }
+    }
+    for (; i < frames; i++) {
+        dest[i] = src[i * channels];
+    }
+}
+
+void PcmScaleTo32(const int16_t* src, int32_t* dest, size_t samples, int32_t factor) {
+    factor = std::clamp<int32_t>(factor, 0, 65536);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        dest[i] = src[i] * factor;
+        dest[i + 1] = src[i + 1] * factor;
+        dest[i + 2] = src[i + 2] * factor;
+        dest[i + 3] = src[i + 3] * factor;
+    }
+    for (; i < samples; i++) {
+        dest[i] = src[i] * factor;
+    }
+}
+
+void PcmConvert32To16(const int32_t* src, int16_t* dest, size_t samples, int shift) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        dest[i] = Saturate16(src[i] >> shift);
+        dest[i + 1] = Saturate16(src[i + 1] >> shift);
+        dest[i + 2] = Saturate16(src[i + 2] >> shift);
+        dest[i + 3] = Saturate16(src[i + 3] >> shift);
+    }
+    for (; i < samples; i++) {
+        dest[i] = Saturate16(src[i] >> shift);
+    }
+}
+
+void PcmApplyGain(int16_t* data, size_t samples, int gain) {
+    // Larger gains would overflow the 32-bit product, and are far beyond full scale anyway
+    gain = std::clamp(gain, -65535, 65535);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        data[i] = Saturate16(data[i] * gain);
+        data[i + 1] = Saturate16(data[i + 1] * gain);
+        data[i + 2] = Saturate16(data[i + 2] * gain);
+        data[i + 3] = Saturate16(data[i + 3] * gain);
+    }
+    for (; i < samples; i++) {
+        data[i] = Saturate16(data[i] * gain);
+    }
+}
+
+void PcmMixTo32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain_from, int32_t gain_to) {
+    gain_from = std::clamp<int32_t>(gain_from, 0, 65536);
+    gain_to = std::clamp<int32_t>(gain_to, 0, 65536);
+    size_t i = 0;
+    if (gain_from == gain_to) {
+        for (; i + 4 <= samples; i += 4) {
+            dest[i] += (src[i] * gain_from) >> 16;
+            dest[i + 1] += (src[i + 1] * gain_from) >> 16;
+            dest[i + 2] += (src[i + 2] * gain_from) >> 16;
+            dest[i + 3] += (src[i + 3] * gain_from) >> 16;
+        }
+        for (; i < samples; i++) {
+            dest[i] += (src[i] * gain_from) >> 16;
+        }
+        return;
+    }
+    // The ramp keeps 8 more fraction bits, so a slow ramp over a long block does not stall
+    int32_t gain = gain_from * 256;
+    int32_t step = (gain_to - gain_from) * 256 / (int32_t)std::max<size_t>(samples, 1);
+    for (; i < samples; i++) {
+        dest[i] += (src[i] * (gain >> 8)) >> 16;
+        gain += step;
+    }
+}
+
+void PcmApplyGainRamp(int16_t* data, size_t samples, int32_t gain_from, int32_t gain_to) {
+    gain_from = std::clamp<int32_t>(gain_from, 0, 65536);
+    gain_to = std::clamp<int32_t>(gain_to, 0, 65536);
+    int32_t gain = gain_from * 256;
+    int32_t step = (gain_to - gain_from) * 256 / (int32_t)std::max<size_t>(samples, 1);
+    for (size_t i = 0; i < samples; i++) {
+        data[i] = (int16_t)((data[i] * (gain >> 8)) >> 16);
+        gain += step;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef PCM_KERNELS_H
+#define PCM_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Sample loops that run on every audio frame. They are unrolled, branch-free and never allocate.
+ * A target specific version (e.g. ESP32-S3 PIE) can be dropped in here without touching the callers.
+ * Saturation is symmetric (-INT16_MAX to INT16_MAX), like the loops these replace.
+ */
+
+// Copy one channel out of interleaved samples. dest may be src, for de-interleaving in place.
+void PcmExtractChannel(const int16_t* src, int16_t* dest, size_t frames, int channels, int channel);
+
+// dest = src * factor, factor is a Q16 volume (0 - 65536), so the product always fits in 32 bits
+void PcmScaleTo32(const int16_t* src, int32_t* dest, size_t samples, int32_t factor);
+
+// dest = saturate(src >> shift), for I2S microphones that deliver 32-bit slots
+void PcmConvert32To16(const int32_t* src, int16_t* dest, size_t samples, int shift);
+
+// data = saturate(data * gain)
+void PcmApplyGain(int16_t* data, size_t samples, int gain);
+
+// data = data * gain >> 16, the Q16 gain (0 - 65536) ramps linearly from gain_from towards gain_to
+void PcmApplyGainRamp(int16_t* data, size_t samples, int32_t gain_from, int32_t gain_to);
+
+// dest += (src * gain) >> 16, the Q16 gain (0 - 65536) ramps linearly from gain_from towards gain_to
+void PcmMixTo32(const int16_t* src, int32_t* dest, size_t samples, int32_t gain_from, int32_t gain_to);
+
+#endif // PCM_KERNELS_H
@@ -0,0 +1,69 @@
+#include "playout_tracker.h"
+
+#include <algorithm>
+
+void PlayoutTracker::Initialize(int output_sample_rate, int dma_latency_samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_sample_rate_ = output_sample_rate;
+    dma_latency_us_ = SamplesToUs(dma_latency_samples);
+}
+
+int64_t PlayoutTracker::SamplesToUs(size_t samples) const {
+    return (int64_t)samples * 1000000 / output_sample_rate_;
+}
+
+void PlayoutTracker::PutVoiceFrame(uint32_t timestamp) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_timestamp_ = timestamp;
+    frame_offset_ = 0;
+}
+
+void PlayoutTracker::OnOutput(size_t samples, size_t voice_samples, int64_t write_start_us, int64_t write_done_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (output_sample_rate_ == 0 || samples == 0) {
+        return;
+    }
+    int64_t duration_us = SamplesToUs(samples);
+    int64_t start_us = playout_end_us_ > write_start_us ? playout_end_us_ : write_start_us + dma_latency_us_;
+    // The write returned once the last sample was in the ring, so it plays within a ring from now
+    start_us = std::min(start_us, write_done_us + dma_latency_us_ - duration_us);
+    playout_end_us_ = start_us + duration_us;
+
+    if (voice_samples == 0) {
+        return;
+    }
+    if (frame_timestamp_ > 0) {
+        auto& segment = segments_[segment_next_];
+        segment.timestamp = frame_timestamp_;
+        segment.frame_offset_us = SamplesToUs(frame_offset_);
+        segment.start_us = start_us;
+        segment.end_us = start_us + SamplesToUs(voice_samples);
+        segment_next_ = (segment_next_ + 1) % segments_.size();
+        segment_count_ = std::min(segment_count_ + 1, segments_.size());
+    }
+    frame_offset_ += voice_samples;
+}
+
+void PlayoutTracker::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_timestamp_ = 0;
+    frame_offset_ = 0;
+    playout_end_us_ = 0;
+    segment_count_ = 0;
+    segment_next_ = 0;
+}
+
+uint32_t PlayoutTracker::GetTimestamp(int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 1; i <= segment_count_; i++) {
+        auto& segment = segments_[(segment_next_ + segments_.size() - i) % segments_.size()];
+        if (time_us >= segment.end_us) {
+            // Segments are in playout order, nothing older can match
+            return 0;
+        }
+        if (time_us >= segment.start_us) {
+            return segment.timestamp + (uint32_t)((segment.frame_offset_us + time_us - segment.start_us) / 1000);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef PLAYOUT_TRACKER_H
+#define PLAYOUT_TRACKER_H
+
+#include <array>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+// Enough blocks to cover the DMA ring plus the capture and processing delay
+#define PLAYOUT_TRACKER_SEGMENTS 32
+
+/*
+ * Tracks when each voice sample reaches the speaker, for server AEC.
+ *
+ * The output task reports every block it writes to the codec. A block is heard once the I2S DMA ring ahead of
+ * it has drained, so it starts where the previous block ends while the output runs continuously, and a DMA ring
+ * after the write started when the output had run dry. Blocking writes return once the last sample is in the
+ * ring, which bounds the estimate and keeps it from drifting. Capture asks which voice sample was playing when
+ * a frame was recorded and gets the packet timestamp plus the offset into that packet, in milliseconds.
+ * Everything is kept in microseconds, so the decode (e.g. 60 ms at 24 kHz) and capture (60 ms at 16 kHz) frame
+ * sizes do not have to line up. PutVoiceFrame() and OnOutput() run on the output task, the rest on any task.
+ */
+class PlayoutTracker {
+public:
+    void Initialize(int output_sample_rate, int dma_latency_samples);
+
+    // The next voice frame enters the mixer
+    void PutVoiceFrame(uint32_t timestamp);
+    // A block was written to the codec, voice_samples of it were taken from the current voice frame
+    void OnOutput(size_t samples, size_t voice_samples, int64_t write_start_us, int64_t write_done_us);
+    // The output was flushed or the voice stream restarted
+    void Reset();
+
+    // The timestamp of the voice heard at that time, 0 if none was playing
+    uint32_t GetTimestamp(int64_t time_us);
+
+private:
+    struct Segment {
+        uint32_t timestamp = 0;
+        int64_t frame_offset_us = 0;
+        int64_t start_us = 0;
+        int64_t end_us = 0;
+    };
+
+    std::mutex mutex_;
+    int output_sample_rate_ = 0;
+    int64_t dma_latency_us_ = 0;
+    uint32_t frame_timestamp_ = 0;
+    size_t frame_offset_ = 0;
+    int64_t playout_end_us_ = 0;
+    std::array<Segment, PLAYOUT_TRACKER_SEGMENTS> segments_;
+    size_t segment_count_ = 0;
+    size_t segment_next_ = 0;
+
+    int64_t SamplesToUs(size_t samples) const;
+};
+
+#endif // PLAYOUT_TRACKER_H
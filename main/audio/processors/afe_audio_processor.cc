@@ -1,5 +1,7 @@
 #include "afe_audio_processor.h"
 #include <esp_log.h>
+#include <cstdlib>
+#include <utility>
 
 #define PROCESSOR_RUNNING 0x01
 
@@ -88,6 +90,10 @@ size_t AfeAudioProcessor::GetFeedSize() {
     return afe_iface_->get_feed_chunksize(afe_data_);
 }
 
+void AfeAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (afe_data_ == nullptr) {
         return;
@@ -98,11 +104,41 @@ void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (!IsRunning()) {
         return;
     }
-    input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
-    size_t chunk_size = afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels();
-    while (input_buffer_.size() >= chunk_size) {
-        afe_iface_->feed(afe_data_, input_buffer_.data());
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunk_size);
+    if (reference_delay_ != 0 && codec_->input_reference()) {
+        DelayChannels(data);
+    }
+    input_buffer_.Resize(afe_iface_->get_feed_chunksize(afe_data_) * codec_->input_channels());
+    input_buffer_.Write(data.data(), data.size());
+    while (auto chunk = input_buffer_.PeekChunk()) {
+        afe_iface_->feed(afe_data_, chunk);
+        input_buffer_.PopChunk();
+    }
+}
+
+void AfeAudioProcessor::SetReferenceDelay(int samples) {
+    std::lock_guard<std::mutex> lock(input_buffer_mutex_);
+    reference_delay_ = samples;
+    delay_history_.clear();
+    delay_position_ = 0;
+    ESP_LOGI(TAG, "Reference delay: %d samples", samples);
+}
+
+void AfeAudioProcessor::DelayChannels(std::vector<int16_t>& data) {
+    // The reference is the last channel
+    int channels = codec_->input_channels();
+    int first = reference_delay_ > 0 ? channels - 1 : 0;
+    int count = reference_delay_ > 0 ? 1 : channels - 1;
+    size_t length = std::abs(reference_delay_);
+    if (delay_history_.empty()) {
+        delay_history_.assign(length * count, 0);
+    }
+    // Each frame swaps its delayed channels with the ones stored a delay ago
+    for (size_t i = 0; i + channels <= data.size(); i += channels) {
+        int16_t* slot = &delay_history_[delay_position_ * count];
+        for (int c = 0; c < count; c++) {
+            std::swap(slot[c], data[i + first + c]);
+        }
+        delay_position_ = (delay_position_ + 1) % length;
     }
 }
 
@@ -117,7 +153,9 @@ void AfeAudioProcessor::Stop() {
     if (afe_data_ != nullptr) {
         afe_iface_->reset_buffer(afe_data_);
     }
-    input_buffer_.clear();
+    input_buffer_.Clear();
+    delay_history_.clear();
+    delay_position_ = 0;
 }
 
 bool AfeAudioProcessor::IsRunning() {
@@ -170,16 +208,17 @@ void AfeAudioProcessor::AudioProcessorTask() {
             output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
             
             // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
+            size_t frame_samples = frame_samples_;
+            while (output_buffer_.size() >= frame_samples) {
+                if (output_buffer_.size() == frame_samples) {
                     // If buffer size equals frame size, move the entire buffer
                     output_callback_(std::move(output_buffer_));
                     output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
+                    output_buffer_.reserve(frame_samples);
                 } else {
                     // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
+                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples));
+                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples);
                 }
             }
         }
@@ -10,9 +10,11 @@
 #include <vector>
 #include <functional>
 #include <mutex>
+#include <atomic>
 
 #include "audio_processor.h"
 #include "audio_codec.h"
+#include "chunk_ring_buffer.h"
 
 class AfeAudioProcessor : public AudioProcessor {
 public:
@@ -27,7 +29,9 @@ public:
     void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) override;
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
+    void SetFrameDuration(int frame_duration_ms) override;
     void EnableDeviceAec(bool enable) override;
+    void SetReferenceDelay(int samples) override;
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
@@ -36,13 +40,18 @@ private:
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     AudioCodec* codec_ = nullptr;
-    int frame_samples_ = 0;
+    std::atomic<int> frame_samples_{0};
     bool is_speaking_ = false;
-    std::vector<int16_t> input_buffer_;
+    ChunkRingBuffer input_buffer_;
     std::mutex input_buffer_mutex_;
     std::vector<int16_t> output_buffer_;
+    // Delay line for the reference or the microphone channels, guarded by input_buffer_mutex_
+    int reference_delay_ = 0;
+    std::vector<int16_t> delay_history_;
+    size_t delay_position_ = 0;
 
     void AudioProcessorTask();
+    void DelayChannels(std::vector<int16_t>& data);
 };
 
 #endif 
\ No newline at end of file
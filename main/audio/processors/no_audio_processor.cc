@@ -1,4 +1,5 @@
 #include "no_audio_processor.h"
+#include "pcm_kernels.h"
 #include <esp_log.h>
 
 #define TAG "NoAudioProcessor"
@@ -14,15 +15,12 @@ void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
     }
 
     if (codec_->input_channels() == 2) {
-        // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
-        }
-        output_callback_(std::move(mono_data));
-    } else {
-        output_callback_(std::move(data));
+        // If input channels is 2, we need to fetch the left channel data, in place
+        size_t frames = data.size() / 2;
+        PcmExtractChannel(data.data(), data.data(), frames, 2, 0);
+        data.resize(frames);
     }
+    output_callback_(std::move(data));
 }
 
 void NoAudioProcessor::Start() {
@@ -52,8 +50,15 @@ size_t NoAudioProcessor::GetFeedSize() {
     return frame_samples_;
 }
 
+void NoAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 void NoAudioProcessor::EnableDeviceAec(bool enable) {
     if (enable) {
         ESP_LOGE(TAG, "Device AEC is not supported");
     }
 }
+
+void NoAudioProcessor::SetReferenceDelay(int samples) {
+}
@@ -0,0 +1,104 @@
+#include "sound_cache.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "SoundCache"
+
+SoundCache::~SoundCache() {
+    Clear();
+    if (recording_buffer_ != nullptr) {
+        heap_caps_free(recording_buffer_);
+    }
+}
+
+void SoundCache::Initialize(int sample_rate) {
+    if (recording_buffer_ != nullptr) {
+        return;
+    }
+    size_t capacity = (size_t)sample_rate * SOUND_CACHE_MAX_SOUND_MS / 1000;
+    recording_buffer_ = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (recording_buffer_ == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM, sound cache disabled");
+        return;
+    }
+    recording_capacity_ = capacity;
+}
+
+const SoundCacheEntry* SoundCache::Find(std::string_view sound) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->data == sound.data() && it->size == sound.size()) {
+            // Most recently used first
+            entries_.splice(entries_.begin(), entries_, it);
+            return &entries_.front();
+        }
+    }
+    return nullptr;
+}
+
+void SoundCache::Begin(std::string_view sound) {
+    recording_sound_ = sound;
+    recording_samples_ = 0;
+    recording_ = recording_capacity_ > 0;
+}
+
+void SoundCache::Append(const int16_t* pcm, size_t samples) {
+    if (!recording_) {
+        return;
+    }
+    if (recording_samples_ + samples > recording_capacity_) {
+        // Too long to be worth caching
+        recording_ = false;
+        return;
+    }
+    memcpy(recording_buffer_ + recording_samples_, pcm, samples * sizeof(int16_t));
+    recording_samples_ += samples;
+}
+
+void SoundCache::Commit() {
+    if (!recording_ || recording_samples_ == 0) {
+        Abort();
+        return;
+    }
+    recording_ = false;
+
+    size_t bytes = recording_samples_ * sizeof(int16_t);
+    while (!entries_.empty() && size_ + bytes > SOUND_CACHE_CAPACITY) {
+        Evict();
+    }
+    auto pcm = (int16_t*)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM);
+    if (pcm == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate %u bytes for sound", (unsigned)bytes);
+        return;
+    }
+    memcpy(pcm, recording_buffer_, bytes);
+
+    SoundCacheEntry entry;
+    entry.data = recording_sound_.data();
+    entry.size = recording_sound_.size();
+    entry.pcm = pcm;
+    entry.samples = recording_samples_;
+    entries_.push_front(entry);
+    size_ += bytes;
+    ESP_LOGI(TAG, "Cached sound: %u samples, %u sounds, %u bytes in cache",
+        (unsigned)entry.samples, (unsigned)entries_.size(), (unsigned)size_);
+}
+
+void SoundCache::Abort() {
+    recording_ = false;
+    recording_samples_ = 0;
+}
+
+void SoundCache::Clear() {
+    while (!entries_.empty()) {
+        Evict();
+    }
+}
+
+void SoundCache::Evict() {
+    auto& entry = entries_.back();
+    size_ -= entry.samples * sizeof(int16_t);
+    heap_caps_free(entry.pcm);
+    entries_.pop_back();
+}
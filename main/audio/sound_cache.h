@@ -0,0 +1,56 @@
+#ifndef SOUND_CACHE_H
+#define SOUND_CACHE_H
+
+#include <list>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#define SOUND_CACHE_CAPACITY (256 * 1024)
+// Only short prompts are kept, longer sounds are decoded every time
+#define SOUND_CACHE_MAX_SOUND_MS 1500
+
+struct SoundCacheEntry {
+    const char* data = nullptr;
+    size_t size = 0;
+    int16_t* pcm = nullptr;
+    size_t samples = 0;
+};
+
+/*
+ * Decoded and resampled PCM of recently played local sounds, least recently used first out.
+ *
+ * A sound is identified by the address and size of its OGG data, which lives in flash or the assets partition
+ * and never moves. The PCM is kept in PSRAM, without PSRAM the cache stays disabled.
+ * A miss is recorded with Begin() / Append() while it is decoded and stored by Commit() once it has finished.
+ * Not thread safe, only the decoder task uses it. An entry stays valid until the next Commit() or Clear().
+ */
+class SoundCache {
+public:
+    ~SoundCache();
+
+    void Initialize(int sample_rate);
+    const SoundCacheEntry* Find(std::string_view sound);
+
+    void Begin(std::string_view sound);
+    void Append(const int16_t* pcm, size_t samples);
+    void Commit();
+    void Abort();
+
+    void Clear();
+    size_t size() const { return size_; }
+
+private:
+    std::list<SoundCacheEntry> entries_;
+    size_t size_ = 0;
+
+    int16_t* recording_buffer_ = nullptr;
+    size_t recording_capacity_ = 0;
+    size_t recording_samples_ = 0;
+    std::string_view recording_sound_;
+    bool recording_ = false;
+
+    void Evict();
+};
+
+#endif // SOUND_CACHE_H
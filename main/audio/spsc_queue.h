@@ -0,0 +1,86 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Bounded single-producer / single-consumer ring buffer.
+ *
+ * Push() may only be called from one producer task and Pop() from one consumer task at a time.
+ * Size(), Empty(), Full() and Clear() are safe to call from any task.
+ *
+ * Clear() does not touch the slots (they belong to the consumer), it only records a discard mark.
+ * The consumer drops everything below the mark on its next Pop(), so a clear never races with an
+ * in-flight Pop() and items pushed after the clear are kept.
+ */
+template <typename T, size_t N>
+class SpscQueue {
+public:
+    static_assert(N > 0, "SpscQueue capacity must be greater than 0");
+
+    bool Push(T&& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= N) {
+            return false;
+        }
+        slots_[head % N] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        while (tail != head && (int32_t)(discard - tail) > 0) {
+            slots_[tail % N] = T();
+            tail++;
+        }
+        if (tail == head) {
+            tail_.store(tail, std::memory_order_release);
+            return false;
+        }
+        item = std::move(slots_[tail % N]);
+        slots_[tail % N] = T();
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    void Clear() {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t discard = discard_.load(std::memory_order_relaxed);
+        while ((int32_t)(head - discard) > 0 &&
+               !discard_.compare_exchange_weak(discard, head, std::memory_order_acq_rel)) {
+        }
+    }
+
+    size_t Size() const {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t discard = discard_.load(std::memory_order_acquire);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t start = (int32_t)(discard - tail) > 0 ? discard : tail;
+        return (int32_t)(head - start) > 0 ? head - start : 0;
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+    // Full() counts the slots that are still waiting to be reclaimed by the consumer after Clear()
+    bool Full() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire) >= N;
+    }
+
+    static constexpr size_t Capacity() { return N; }
+
+private:
+    std::array<T, N> slots_;
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> discard_{0};
+};
+
+#endif // SPSC_QUEUE_H
@@ -48,6 +48,9 @@ void EspWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
     wake_word_detected_callback_ = callback;
 }
 
+void EspWakeWord::OnVadStateChange(std::function<void(bool speaking)> callback) {
+}
+
 void EspWakeWord::Start() {
     running_ = true;
 }
@@ -56,7 +59,7 @@ void EspWakeWord::Stop() {
     running_ = false;
 
     std::lock_guard<std::mutex> lock(input_buffer_mutex_);
-    input_buffer_.clear();
+    input_buffer_.Clear();
 }
 
 void EspWakeWord::Feed(const std::vector<int16_t>& data) {
@@ -70,28 +73,26 @@ void EspWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
+    input_buffer_.Resize(wakenet_iface_->get_samp_chunksize(wakenet_data_));
     if (codec_->input_channels() == 2) {
-        for (size_t i = 0; i < data.size(); i += 2) {
-            input_buffer_.push_back(data[i]);
-        }
+        input_buffer_.WriteChannel(data.data(), data.size() / 2, 2, 0);
     } else {
-        input_buffer_.insert(input_buffer_.end(), data.begin(), data.end());
+        input_buffer_.Write(data.data(), data.size());
     }
 
-    int chunksize = wakenet_iface_->get_samp_chunksize(wakenet_data_);
-    while (input_buffer_.size() >= chunksize) {
-        int res = wakenet_iface_->detect(wakenet_data_, input_buffer_.data());
+    while (auto chunk = input_buffer_.PeekChunk()) {
+        int res = wakenet_iface_->detect(wakenet_data_, (int16_t*)chunk);
         if (res > 0) {
             last_detected_wake_word_ = wakenet_iface_->get_word_name(wakenet_data_, res);
             running_ = false;
-            input_buffer_.clear();
+            input_buffer_.Clear();
 
             if (wake_word_detected_callback_) {
                 wake_word_detected_callback_(last_detected_wake_word_);
             }
             break;
         }
-        input_buffer_.erase(input_buffer_.begin(), input_buffer_.begin() + chunksize);
+        input_buffer_.PopChunk();
     }
 }
 
@@ -102,6 +103,9 @@ size_t EspWakeWord::GetFeedSize() {
     return wakenet_iface_->get_samp_chunksize(wakenet_data_);
 }
 
+void EspWakeWord::SetEncoderProfile(const OpusEncoderProfile& profile) {
+}
+
 void EspWakeWord::EncodeWakeWordData() {
 }
 
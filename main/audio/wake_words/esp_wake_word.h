@@ -13,6 +13,7 @@
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "chunk_ring_buffer.h"
 
 class EspWakeWord : public WakeWord {
 public:
@@ -22,9 +23,11 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnVadStateChange(std::function<void(bool speaking)> callback);
     void Start();
     void Stop();
     size_t GetFeedSize();
+    void SetEncoderProfile(const OpusEncoderProfile& profile);
     void EncodeWakeWordData();
     bool GetWakeWordOpus(std::vector<uint8_t>& opus);
     const std::string& GetLastDetectedWakeWord() const { return last_detected_wake_word_; }
@@ -38,7 +41,7 @@ private:
 
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     std::string last_detected_wake_word_;
-    std::vector<int16_t> input_buffer_;
+    ChunkRingBuffer input_buffer_;
     std::mutex input_buffer_mutex_;
 };
 
@@ -0,0 +1,224 @@
+#include "wake_word_preroll.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cassert>
+
+#define TAG "WakeWordPreroll"
+
+WakeWordPreroll::WakeWordPreroll() {
+}
+
+WakeWordPreroll::~WakeWordPreroll() {
+    if (encode_task_ != nullptr) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            exit_ = true;
+            cv_.notify_all();
+            cv_.wait(lock, [this]() { return !task_running_; });
+        }
+        // The task waits to be deleted, so its stack is no longer in use when we free it
+        vTaskDelete(encode_task_);
+    }
+
+    if (encode_task_stack_ != nullptr) {
+        heap_caps_free(encode_task_stack_);
+    }
+
+    if (encode_task_buffer_ != nullptr) {
+        heap_caps_free(encode_task_buffer_);
+    }
+}
+
+void WakeWordPreroll::Initialize() {
+    if (encode_task_ != nullptr) {
+        return;
+    }
+
+    // Boards without PSRAM fall back to internal RAM, the pre-roll is left out if that fails too
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_PREROLL_TASK_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    if (encode_task_stack_ == nullptr) {
+        encode_task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_PREROLL_TASK_STACK_SIZE, MALLOC_CAP_INTERNAL);
+    }
+    encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    if (encode_task_stack_ == nullptr || encode_task_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the pre-roll encoder task, wake word audio will not be sent");
+        heap_caps_free(encode_task_stack_);
+        heap_caps_free(encode_task_buffer_);
+        encode_task_stack_ = nullptr;
+        encode_task_buffer_ = nullptr;
+        return;
+    }
+
+    task_running_ = true;
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordPreroll*)arg;
+        this_->EncodeTask();
+        vTaskSuspend(NULL);
+    }, "wake_word_preroll", WAKE_WORD_PREROLL_TASK_STACK_SIZE, this, 2, encode_task_stack_, encode_task_buffer_);
+}
+
+void WakeWordPreroll::SetEncoderProfile(const OpusEncoderProfile& profile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (profile == profile_) {
+        return;
+    }
+    profile_ = profile;
+    reopen_ = true;
+    cv_.notify_all();
+}
+
+void WakeWordPreroll::Append(const int16_t* data, size_t samples) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (frame_size_ == 0) {
+        return;
+    }
+    if (finishing_) {
+        ResetLocked();
+    }
+    size_t dropped = pcm_.dropped_chunks();
+    pcm_.Write(data, samples);
+    if (pcm_.dropped_chunks() != dropped && dropped == reported_dropped_chunks_) {
+        // Logged once per pre-roll, the total is logged by Finish()
+        ESP_LOGW(TAG, "Pre-roll encoder is falling behind, dropping audio");
+    }
+    if (pcm_.PeekChunk() != nullptr) {
+        cv_.notify_all();
+    }
+}
+
+void WakeWordPreroll::Finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encode_task_ == nullptr) {
+        // Not initialized, there is nothing to encode and Pop() must not wait
+        return;
+    }
+    ESP_LOGI(TAG, "Wake word pre-roll: %u packets ready, %u samples left to encode, %u chunks dropped",
+        (unsigned)packet_count_, (unsigned)pcm_.size(), (unsigned)(pcm_.dropped_chunks() - reported_dropped_chunks_));
+    reported_dropped_chunks_ = pcm_.dropped_chunks();
+    finishing_ = true;
+    finished_ = false;
+    cv_.notify_all();
+}
+
+bool WakeWordPreroll::Pop(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() {
+        return packet_count_ > 0 || finished_ || !finishing_;
+    });
+    if (packet_count_ == 0) {
+        return false;
+    }
+    auto& packet = packets_[packet_head_];
+    opus.assign(packet.begin(), packet.end());
+    packet_head_ = (packet_head_ + 1) % packets_.size();
+    packet_count_--;
+    return true;
+}
+
+void WakeWordPreroll::ResetLocked() {
+    pcm_.Clear();
+    packet_head_ = 0;
+    packet_count_ = 0;
+    finishing_ = false;
+    finished_ = false;
+    generation_++;
+}
+
+void WakeWordPreroll::PushPacketLocked(const uint8_t* data, size_t size) {
+    if (packets_.empty()) {
+        return;
+    }
+    // Overwrite the oldest packet when the ring is full, the slot keeps its capacity
+    size_t index = (packet_head_ + packet_count_) % packets_.size();
+    if (packet_count_ == packets_.size()) {
+        packet_head_ = (packet_head_ + 1) % packets_.size();
+    } else {
+        packet_count_++;
+    }
+    packets_[index].assign(data, data + size);
+    cv_.notify_all();
+}
+
+void WakeWordPreroll::EncodeTask() {
+    void* encoder = nullptr;
+    std::vector<int16_t> frame;
+    std::vector<uint8_t> output;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() {
+            return exit_ || reopen_ || pcm_.PeekChunk() != nullptr || (finishing_ && !finished_);
+        });
+        if (exit_) {
+            break;
+        }
+
+        if (reopen_) {
+            reopen_ = false;
+            auto profile = profile_;
+            lock.unlock();
+
+            if (encoder != nullptr) {
+                esp_opus_enc_close(encoder);
+                encoder = nullptr;
+            }
+            int frame_size = 0;
+            int outbuf_size = 0;
+            esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG(profile);
+            auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+            if (encoder == nullptr) {
+                ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+            } else {
+                esp_opus_enc_get_frame_size(encoder, &frame_size, &outbuf_size);
+                output.resize(outbuf_size);
+            }
+
+            lock.lock();
+            frame_size_ = frame_size / sizeof(int16_t);
+            frame.resize(frame_size_);
+            pcm_.Resize(frame_size_);
+            packets_.resize(frame_size_ > 0 ? WAKE_WORD_PREROLL_DURATION_MS / profile.frame_duration_ms : 0);
+            ResetLocked();
+            cv_.notify_all();
+            continue;
+        }
+
+        if (auto chunk = pcm_.PeekChunk()) {
+            // Copy the frame out, so Append() can keep writing while it is encoded
+            std::copy(chunk, chunk + frame_size_, frame.begin());
+            pcm_.PopChunk();
+            auto generation = generation_;
+            lock.unlock();
+
+            esp_audio_enc_in_frame_t in = {};
+            esp_audio_enc_out_frame_t out = {};
+            in.buffer = (uint8_t*)frame.data();
+            in.len = (uint32_t)(frame.size() * sizeof(int16_t));
+            out.buffer = output.data();
+            out.len = output.size();
+            out.encoded_bytes = 0;
+            auto ret = esp_opus_enc_process(encoder, &in, &out);
+
+            lock.lock();
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            } else if (generation == generation_) {
+                PushPacketLocked(output.data(), out.encoded_bytes);
+            }
+            continue;
+        }
+
+        // Finishing and less than a frame is left, the partial frame is dropped
+        finished_ = true;
+        cv_.notify_all();
+    }
+
+    if (encoder != nullptr) {
+        esp_opus_enc_close(encoder);
+    }
+    task_running_ = false;
+    cv_.notify_all();
+}
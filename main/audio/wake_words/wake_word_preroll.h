@@ -0,0 +1,70 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "protocol.h"
+#include "chunk_ring_buffer.h"
+
+// About 2 seconds of audio before the wake word is detected
+#define WAKE_WORD_PREROLL_DURATION_MS 2000
+#define WAKE_WORD_PREROLL_TASK_STACK_SIZE (4096 * 7)
+
+/*
+ * The audio leading up to a wake word, kept as Opus packets so it can be sent as soon as the audio channel opens.
+ *
+ * The detection path only copies PCM in with Append(). A low priority task encodes it one frame at a time while
+ * the device is waiting for the wake word, and keeps the newest WAKE_WORD_PREROLL_DURATION_MS of packets in a
+ * ring whose slots are reused. On detection, Finish() only has to wait for the frames still in flight.
+ * The wake words only initialize and feed it with CONFIG_SEND_WAKE_WORD_DATA, nothing else reads the packets.
+ */
+class WakeWordPreroll {
+public:
+    WakeWordPreroll();
+    ~WakeWordPreroll();
+
+    void Initialize();
+    void SetEncoderProfile(const OpusEncoderProfile& profile);
+
+    // Called from the detection path, the first call after Finish() starts a new pre-roll
+    void Append(const int16_t* data, size_t samples);
+    // The wake word is detected, encode what is left
+    void Finish();
+    // Blocks until the next packet is ready, returns false after the last one
+    bool Pop(std::vector<uint8_t>& opus);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t* encode_task_buffer_ = nullptr;
+    StackType_t* encode_task_stack_ = nullptr;
+    bool exit_ = false;
+    bool task_running_ = false;
+
+    OpusEncoderProfile profile_;
+    bool reopen_ = true;
+    size_t frame_size_ = 0;
+    // Bumped whenever the buffered audio is dropped, so a frame that was being encoded is not stored
+    uint32_t generation_ = 0;
+    ChunkRingBuffer pcm_;
+    // PCM chunks the encoder could not keep up with, counted from pcm_ and reported by Finish()
+    size_t reported_dropped_chunks_ = 0;
+    std::vector<std::vector<uint8_t>> packets_;
+    size_t packet_head_ = 0;
+    size_t packet_count_ = 0;
+    bool finishing_ = false;
+    bool finished_ = false;
+
+    void EncodeTask();
+    void ResetLocked();
+    void PushPacketLocked(const uint8_t* data, size_t size);
+};
+
+#endif // WAKE_WORD_PREROLL_H
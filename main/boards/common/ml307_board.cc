@@ -190,7 +190,8 @@ std::string Ml307Board::GetDeviceStatusJson() {
      * 返回的JSON结构如下：
      * {
      *     "audio_speaker": {
-     *         "volume": 70
+     *         "volume": 70,
+     *         "latency_mode": "balanced"
      *     },
      *     "screen": {
      *         "brightness": 100,
@@ -215,6 +216,7 @@ std::string Ml307Board::GetDeviceStatusJson() {
     auto audio_codec = board.GetAudioCodec();
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
+        cJSON_AddStringToObject(audio_speaker, "latency_mode", audio_codec->latency_mode_name());
     }
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
@@ -215,6 +215,7 @@ std::string Nt26Board::GetDeviceStatusJson() {
     auto audio_codec = board.GetAudioCodec();
     if (audio_codec) {
         cJSON_AddNumberToObject(audio_speaker, "volume", audio_codec->output_volume());
+        cJSON_AddStringToObject(audio_speaker, "latency_mode", audio_codec->latency_mode_name());
     }
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
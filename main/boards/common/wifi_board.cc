@@ -307,6 +307,7 @@ std::string WifiBoard::GetDeviceStatusJson() {
     auto audio_speaker = cJSON_CreateObject();
     if (auto codec = board.GetAudioCodec()) {
         cJSON_AddNumberToObject(audio_speaker, "volume", codec->output_volume());
+        cJSON_AddStringToObject(audio_speaker, "latency_mode", codec->latency_mode_name());
     }
     cJSON_AddItemToObject(root, "audio_speaker", audio_speaker);
 
@@ -148,6 +148,42 @@ void McpServer::AddUserOnlyTools() {
             return true;
         });
 
+    AddUserOnlyTool("self.audio.get_latency", "Get the per-stage audio latency percentiles (p50/p95/p99/max) in milliseconds",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            return app.GetAudioService().latency_tracer().GetJson();
+        });
+
+    AddUserOnlyTool("self.audio.get_power_state", "Get the codec input / output power state, how often each was powered up ahead of time or on demand, and the time spent on",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            return app.GetAudioService().power_governor().GetJson();
+        });
+
+    if (Board::GetInstance().GetAudioCodec()->input_reference()) {
+        AddUserOnlyTool("self.audio.calibrate_aec_delay", "Play a short noise probe and measure the delay between the microphone and the AEC reference channel. The result is saved and used from then on. The device must be idle. The measurement runs in the background for about two seconds, read the result with self.audio.get_aec_delay.",
+            PropertyList(),
+            [this](const PropertyList& properties) -> ReturnValue {
+                auto& app = Application::GetInstance();
+                if (app.GetDeviceState() != kDeviceStateIdle) {
+                    throw std::runtime_error("The device must be idle to calibrate the AEC delay");
+                }
+                if (!app.GetAudioService().StartAecDelayCalibration()) {
+                    throw std::runtime_error("An AEC delay calibration is already running");
+                }
+                return true;
+            });
+
+        AddUserOnlyTool("self.audio.get_aec_delay", "Get the status and the result of the last AEC delay calibration.",
+            PropertyList(),
+            [this](const PropertyList& properties) -> ReturnValue {
+                auto& app = Application::GetInstance();
+                return app.GetAudioService().GetAecCalibrationJson();
+            });
+    }
+
     // Firmware upgrade
     AddUserOnlyTool("self.upgrade_firmware", "Upgrade firmware from a specific URL. This will download and install the firmware, then reboot the device.",
         PropertyList({
@@ -321,10 +357,10 @@ void McpServer::AddUserOnlyTool(const std::string& name, const std::string& desc
     AddTool(tool);
 }
 
-void McpServer::ParseMessage(const std::string& message) {
-    cJSON* json = cJSON_Parse(message.c_str());
+void McpServer::ParseMessage(std::string_view message) {
+    cJSON* json = cJSON_ParseWithLength(message.data(), message.size());
     if (json == nullptr) {
-        ESP_LOGE(TAG, "Failed to parse MCP message: %s", message.c_str());
+        ESP_LOGE(TAG, "Failed to parse MCP message: %.*s", (int)message.size(), message.data());
         return;
     }
     ParseMessage(json);
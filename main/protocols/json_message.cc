@@ -0,0 +1,337 @@
+#include "json_message.h"
+
+#include <cstdint>
+
+/*
+ * Perfect hash of the message types: (name[0] * 2 + name[1] + length) & 15 is unique for every known
+ * type, so a lookup is one hash and one compare instead of a strcmp chain.
+ */
+#define JSON_MESSAGE_TYPE_TABLE_SIZE 16
+
+struct JsonMessageTypeEntry {
+    std::string_view name;
+    JsonMessageType type;
+};
+
+static constexpr size_t HashTypeName(std::string_view name) {
+    return ((unsigned char)name[0] * 2 + (unsigned char)name[1] + name.size()) & (JSON_MESSAGE_TYPE_TABLE_SIZE - 1);
+}
+
+static constexpr std::array<JsonMessageTypeEntry, JSON_MESSAGE_TYPE_TABLE_SIZE> kTypeTable = {{
+    {"mcp", kJsonMessageMcp},           // 0
+    {"custom", kJsonMessageCustom},     // 1
+    {},
+    {"alert", kJsonMessageAlert},       // 3
+    {"goodbye", kJsonMessageGoodbye},   // 4
+    {"system", kJsonMessageSystem},     // 5
+    {},
+    {"llm", kJsonMessageLlm},           // 7
+    {},
+    {},
+    {"hello", kJsonMessageHello},       // 10
+    {},
+    {},
+    {"stt", kJsonMessageStt},           // 13
+    {},
+    {"tts", kJsonMessageTts},           // 15
+}};
+
+static constexpr bool TypeTableIsPerfect() {
+    for (size_t i = 0; i < kTypeTable.size(); i++) {
+        if (!kTypeTable[i].name.empty() && HashTypeName(kTypeTable[i].name) != i) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(TypeTableIsPerfect(), "Every message type must be stored at its hash");
+
+JsonMessageType JsonMessage::ParseType(std::string_view name) {
+    if (name.size() < 2) {
+        return kJsonMessageUnknown;
+    }
+    auto& entry = kTypeTable[HashTypeName(name)];
+    return entry.name == name ? entry.type : kJsonMessageUnknown;
+}
+
+static inline const char* SkipSpace(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// p points after the opening quote, returns the closing quote or nullptr
+static const char* ScanString(const char* p, const char* end, bool* escaped) {
+    while (p < end) {
+        if (*p == '"') {
+            return p;
+        }
+        if (*p == '\\') {
+            *escaped = true;
+            p += 2;
+            continue;
+        }
+        if ((unsigned char)*p < 0x20) {
+            return nullptr;
+        }
+        p++;
+    }
+    return nullptr;
+}
+
+static const char* ScanLiteral(const char* p, const char* end, std::string_view literal) {
+    if ((size_t)(end - p) < literal.size() || std::string_view(p, literal.size()) != literal) {
+        return nullptr;
+    }
+    return p + literal.size();
+}
+
+// p points at the first character of a value that is not a string, returns the end of the value or nullptr
+static const char* ScanValue(const char* p, const char* end, JsonValueKind* kind) {
+    switch (*p) {
+        case '{':
+        case '[': {
+            // Nested values are only checked for balance, they are parsed by whoever uses them
+            *kind = *p == '{' ? kJsonValueObject : kJsonValueArray;
+            int depth = 0;
+            while (p < end) {
+                char c = *p++;
+                if (c == '"') {
+                    bool escaped = false;
+                    p = ScanString(p, end, &escaped);
+                    if (p == nullptr) {
+                        return nullptr;
+                    }
+                    p++;
+                } else if (c == '{' || c == '[') {
+                    depth++;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0) {
+                        return p;
+                    }
+                }
+            }
+            return nullptr;
+        }
+        case 't':
+            *kind = kJsonValueTrue;
+            return ScanLiteral(p, end, "true");
+        case 'f':
+            *kind = kJsonValueFalse;
+            return ScanLiteral(p, end, "false");
+        case 'n':
+            *kind = kJsonValueNull;
+            return ScanLiteral(p, end, "null");
+        default: {
+            *kind = kJsonValueNumber;
+            const char* start = p;
+            while (p < end && ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E')) {
+                p++;
+            }
+            return p > start ? p : nullptr;
+        }
+    }
+}
+
+JsonMessage::JsonMessage(const char* data, size_t length) : text_(data, length) {
+    valid_ = Scan();
+    if (!valid_) {
+        member_count_ = 0;
+        return;
+    }
+    auto type = Find("type");
+    if (type != nullptr && type->kind == kJsonValueString) {
+        type_name_ = type->value;
+        type_ = ParseType(type_name_);
+    }
+}
+
+bool JsonMessage::Scan() {
+    const char* end = text_.data() + text_.size();
+    const char* p = SkipSpace(text_.data(), end);
+    if (p == end || *p != '{') {
+        return false;
+    }
+    p = SkipSpace(p + 1, end);
+    if (p < end && *p == '}') {
+        p++;
+    } else {
+        while (true) {
+            if (p == end || *p != '"') {
+                return false;
+            }
+            JsonMember member = {};
+            const char* key_end = ScanString(p + 1, end, &member.escaped);
+            if (key_end == nullptr) {
+                return false;
+            }
+            member.key = std::string_view(p + 1, key_end - p - 1);
+            member.escaped = false;
+
+            p = SkipSpace(key_end + 1, end);
+            if (p == end || *p != ':') {
+                return false;
+            }
+            p = SkipSpace(p + 1, end);
+            if (p == end) {
+                return false;
+            }
+            if (*p == '"') {
+                const char* value_end = ScanString(p + 1, end, &member.escaped);
+                if (value_end == nullptr) {
+                    return false;
+                }
+                member.kind = kJsonValueString;
+                member.value = std::string_view(p + 1, value_end - p - 1);
+                p = value_end + 1;
+            } else {
+                const char* value_end = ScanValue(p, end, &member.kind);
+                if (value_end == nullptr) {
+                    return false;
+                }
+                member.value = std::string_view(p, value_end - p);
+                p = value_end;
+            }
+            // Members beyond the index are checked but not kept, control messages are much smaller
+            if (member_count_ < members_.size()) {
+                members_[member_count_++] = member;
+            }
+
+            p = SkipSpace(p, end);
+            if (p < end && *p == ',') {
+                p = SkipSpace(p + 1, end);
+                continue;
+            }
+            if (p < end && *p == '}') {
+                p++;
+                break;
+            }
+            return false;
+        }
+    }
+    // Some senders count the terminating zero in the frame length
+    p = SkipSpace(p, end);
+    return p == end || *p == '\0';
+}
+
+const JsonMember* JsonMessage::Find(std::string_view key) const {
+    for (size_t i = 0; i < member_count_; i++) {
+        if (members_[i].key == key) {
+            return &members_[i];
+        }
+    }
+    return nullptr;
+}
+
+bool JsonMessage::IsString(std::string_view key) const {
+    auto member = Find(key);
+    return member != nullptr && member->kind == kJsonValueString;
+}
+
+bool JsonMessage::IsObject(std::string_view key) const {
+    auto member = Find(key);
+    return member != nullptr && member->kind == kJsonValueObject;
+}
+
+std::string_view JsonMessage::GetStringView(std::string_view key) const {
+    auto member = Find(key);
+    if (member == nullptr || member->kind != kJsonValueString) {
+        return std::string_view();
+    }
+    return member->value;
+}
+
+bool JsonMessage::GetString(std::string_view key, std::string& value) const {
+    auto member = Find(key);
+    if (member == nullptr || member->kind != kJsonValueString) {
+        return false;
+    }
+    if (member->escaped) {
+        Unescape(member->value, value);
+    } else {
+        value.assign(member->value.data(), member->value.size());
+    }
+    return true;
+}
+
+static bool ParseHex4(std::string_view text, size_t pos, uint32_t* code) {
+    if (pos + 4 > text.size()) {
+        return false;
+    }
+    uint32_t result = 0;
+    for (size_t i = pos; i < pos + 4; i++) {
+        char c = text[i];
+        result <<= 4;
+        if (c >= '0' && c <= '9') {
+            result |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            result |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            result |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    *code = result;
+    return true;
+}
+
+static void AppendUtf8(std::string& value, uint32_t code) {
+    if (code < 0x80) {
+        value += (char)code;
+    } else if (code < 0x800) {
+        value += (char)(0xC0 | (code >> 6));
+        value += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        value += (char)(0xE0 | (code >> 12));
+        value += (char)(0x80 | ((code >> 6) & 0x3F));
+        value += (char)(0x80 | (code & 0x3F));
+    } else {
+        value += (char)(0xF0 | (code >> 18));
+        value += (char)(0x80 | ((code >> 12) & 0x3F));
+        value += (char)(0x80 | ((code >> 6) & 0x3F));
+        value += (char)(0x80 | (code & 0x3F));
+    }
+}
+
+void JsonMessage::Unescape(std::string_view escaped, std::string& value) {
+    value.clear();
+    value.reserve(escaped.size());
+    for (size_t i = 0; i < escaped.size(); i++) {
+        char c = escaped[i];
+        if (c != '\\' || i + 1 >= escaped.size()) {
+            value += c;
+            continue;
+        }
+        c = escaped[++i];
+        switch (c) {
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'u': {
+                uint32_t code;
+                if (!ParseHex4(escaped, i + 1, &code)) {
+                    value += c;
+                    break;
+                }
+                i += 4;
+                // A character outside the BMP is sent as a surrogate pair
+                uint32_t low;
+                if (code >= 0xD800 && code <= 0xDBFF && i + 2 < escaped.size() && escaped[i + 1] == '\\' &&
+                    escaped[i + 2] == 'u' && ParseHex4(escaped, i + 3, &low) && low >= 0xDC00 && low <= 0xDFFF) {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                }
+                AppendUtf8(value, code);
+                break;
+            }
+            default:
+                // \" \\ \/
+                value += c;
+                break;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef JSON_MESSAGE_H
+#define JSON_MESSAGE_H
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <cstddef>
+
+#define JSON_MESSAGE_MAX_MEMBERS 16
+
+enum JsonMessageType {
+    kJsonMessageUnknown,
+    kJsonMessageHello,
+    kJsonMessageGoodbye,
+    kJsonMessageTts,
+    kJsonMessageStt,
+    kJsonMessageLlm,
+    kJsonMessageMcp,
+    kJsonMessageSystem,
+    kJsonMessageAlert,
+    kJsonMessageCustom,
+};
+
+enum JsonValueKind {
+    kJsonValueString,
+    kJsonValueNumber,
+    kJsonValueObject,
+    kJsonValueArray,
+    kJsonValueTrue,
+    kJsonValueFalse,
+    kJsonValueNull,
+};
+
+struct JsonMember {
+    std::string_view key;
+    // Strings without the quotes and not unescaped, any other value as its raw text
+    std::string_view value;
+    JsonValueKind kind;
+    bool escaped;
+};
+
+/*
+ * A control message from the server, e.g. {"type":"tts","state":"sentence_start","text":"..."}
+ *
+ * The text is scanned once without allocating and only the members of the top level object are indexed.
+ * Nested objects and arrays are kept as raw text (e.g. the MCP payload) for whoever needs to parse them.
+ * All views point into the text, so it must outlive the message.
+ *
+ * GetStringView() returns the string as it is on the wire, which is fine for identifiers like "state".
+ * Use GetString() for text that may contain escapes and is shown or stored.
+ */
+class JsonMessage {
+public:
+    JsonMessage(const char* data, size_t length);
+
+    bool valid() const { return valid_; }
+    JsonMessageType type() const { return type_; }
+    std::string_view type_name() const { return type_name_; }
+    std::string_view text() const { return text_; }
+
+    const JsonMember* Find(std::string_view key) const;
+    bool IsString(std::string_view key) const;
+    bool IsObject(std::string_view key) const;
+    std::string_view GetStringView(std::string_view key) const;
+    bool GetString(std::string_view key, std::string& value) const;
+
+    static JsonMessageType ParseType(std::string_view name);
+    static void Unescape(std::string_view escaped, std::string& value);
+
+private:
+    std::string_view text_;
+    std::array<JsonMember, JSON_MESSAGE_MAX_MEMBERS> members_;
+    size_t member_count_ = 0;
+    bool valid_ = false;
+    JsonMessageType type_ = kJsonMessageUnknown;
+    std::string_view type_name_;
+
+    bool Scan();
+};
+
+#endif // JSON_MESSAGE_H
@@ -4,6 +4,7 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <cstring>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
@@ -23,6 +24,7 @@ MqttProtocol::MqttProtocol() {
                 auto alive = protocol->alive_;  // Capture alive flag
                 app.Schedule([protocol, alive]() {
                     if (*alive) {
+                        std::lock_guard<std::mutex> lock(protocol->connect_mutex_);
                         protocol->StartMqttClient(false);
                     }
                 });
@@ -53,6 +55,7 @@ MqttProtocol::~MqttProtocol() {
 }
 
 bool MqttProtocol::Start() {
+    std::lock_guard<std::mutex> lock(connect_mutex_);
     return StartMqttClient(false);
 }
 
@@ -98,24 +101,28 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
+        // Scanned in place, only the rare hello message is parsed into a cJSON tree
+        JsonMessage message(payload.data(), payload.size());
+        if (!message.valid()) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
+        if (!message.IsString("type")) {
             ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        if (message.type() == kJsonMessageHello) {
+            cJSON* root = cJSON_ParseWithLength(payload.data(), payload.size());
+            if (root != nullptr) {
+                ParseServerHello(root);
+                cJSON_Delete(root);
+            }
+        } else if (message.type() == kJsonMessageGoodbye) {
+            auto session_id = message.Find("session_id");
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %.*s", session_id ? (int)session_id->value.size() : 4,
+                session_id ? session_id->value.data() : "null");
+            if (session_id == nullptr || session_id_ == session_id->value) {
                 auto alive = alive_;  // Capture alive flag
                 Application::GetInstance().Schedule([this, alive]() {
                     if (*alive) {
@@ -125,9 +132,8 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
                 });
             }
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(message);
         }
-        cJSON_Delete(root);
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -168,25 +174,51 @@ bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
     if (udp_ == nullptr) {
         return false;
     }
+    return EncryptAndSendAudio(*packet);
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+bool MqttProtocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    bool success = true;
+    {
+        // One lock for the whole backlog, the datagrams are sent back to back
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        for (auto& packet : packets) {
+            if (udp_ == nullptr || !EncryptAndSendAudio(*packet)) {
+                success = false;
+                break;
+            }
+        }
+    }
+    packets.clear();
+    return success;
+}
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+// Must be called with channel_mutex_ held
+bool MqttProtocol::EncryptAndSendAudio(const AudioStreamPacket& packet) {
+    /*
+     * The datagram is built in udp_send_buffer_, which keeps its capacity between packets:
+     * the nonce header is written in front and AES-CTR writes the ciphertext right after it.
+     */
+    size_t payload_size = packet.payload_size();
+    udp_send_buffer_.resize(aes_nonce_.size() + payload_size);
+    auto nonce = (uint8_t*)udp_send_buffer_.data();
+    memcpy(nonce, aes_nonce_.data(), aes_nonce_.size());
+    *(uint16_t*)&nonce[2] = htons(payload_size);
+    *(uint32_t*)&nonce[8] = htonl(packet.timestamp);
+    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
 
+    // The counter block is advanced by mbedtls, so it must not be the header we send
+    uint8_t counter[16];
+    memcpy(counter, nonce, sizeof(counter));
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, payload_size, &nc_off, counter, stream_block,
+        packet.payload_data(), nonce + aes_nonce_.size()) != 0) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    return udp_->Send(udp_send_buffer_) > 0;
 }
 
 void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
@@ -212,11 +244,26 @@ void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
     }
 }
 
+bool MqttProtocol::PreConnect(int keep_alive_seconds) {
+    // The MQTT connection is persistent, only bring it back early if it dropped.
+    // UDP needs the server hello, which would start a session, so it is left to OpenAudioChannel().
+    std::lock_guard<std::mutex> lock(connect_mutex_);
+    if (mqtt_ != nullptr && mqtt_->IsConnected()) {
+        return true;
+    }
+    ESP_LOGI(TAG, "Pre-connecting to MQTT server");
+    return StartMqttClient(false);
+}
+
 bool MqttProtocol::OpenAudioChannel() {
-    if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
-        ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
-        if (!StartMqttClient(true)) {
-            return false;
+    {
+        // Waits for a pre-connect that is still in progress
+        std::lock_guard<std::mutex> lock(connect_mutex_);
+        if (mqtt_ == nullptr || !mqtt_->IsConnected()) {
+            ESP_LOGI(TAG, "MQTT is not connected, try to connect now");
+            if (!StartMqttClient(true)) {
+                return false;
+            }
         }
     }
 
@@ -246,7 +293,7 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < aes_nonce_.size()) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -256,25 +303,26 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
+        // Out of order and lost packets are handled by the jitter buffer in the audio service
         if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            ESP_LOGD(TAG, "Received audio packet with sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
         }
 
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
+        // Decrypt straight into a pooled packet, the counter block is a copy so the received datagram is not modified
+        uint8_t nonce[16];
+        memcpy(nonce, data.data(), sizeof(nonce));
+        auto encrypted = (const uint8_t*)data.data() + aes_nonce_.size();
         auto packet = std::make_unique<AudioStreamPacket>();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
+        packet->sequence = sequence;
+        packet->origin_time_us = esp_timer_get_time();
         packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
+        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, packet->payload.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
             return;
@@ -282,7 +330,9 @@ bool MqttProtocol::OpenAudioChannel() {
         if (on_incoming_audio_ != nullptr) {
             on_incoming_audio_(std::move(packet));
         }
-        remote_sequence_ = sequence;
+        if (sequence > remote_sequence_) {
+            remote_sequence_ = sequence;
+        }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -305,12 +355,14 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddBoolToObject(features, "encoder_profile", true);
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    // The profile negotiated last is kept until the server asks for another one, so the encoder still uses it
+    cJSON_AddNumberToObject(audio_params, "frame_duration", encoder_profile_.frame_duration_ms);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -344,6 +396,7 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
             server_frame_duration_ = frame_duration->valueint;
         }
     }
+    ParseEncoderProfile(root);
 
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (!cJSON_IsObject(udp)) {
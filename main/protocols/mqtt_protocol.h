@@ -30,9 +30,11 @@ public:
 
     bool Start() override;
     bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    bool PreConnect(int keep_alive_seconds) override;
 
 private:
     // Alive flag for safe scheduled callbacks - set to false in destructor
@@ -43,10 +45,13 @@ private:
     std::string publish_topic_;
 
     std::mutex channel_mutex_;
+    // Held around StartMqttClient(), a pre-connect runs in its own task
+    std::mutex connect_mutex_;
     std::unique_ptr<Mqtt> mqtt_;
     std::unique_ptr<Udp> udp_;
     mbedtls_aes_context aes_ctx_;
     std::string aes_nonce_;
+    std::string udp_send_buffer_;
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
@@ -57,6 +62,7 @@ private:
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
 
+    bool EncryptAndSendAudio(const AudioStreamPacket& packet);
     bool SendText(const std::string& text) override;
     std::string GetHelloMessage();
 };
@@ -1,10 +1,57 @@
 #include "protocol.h"
 
 #include <esp_log.h>
+#include <cassert>
+#include <algorithm>
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+static MemoryPool<AudioStreamPacket, AUDIO_STREAM_PACKET_POOL_SIZE>& GetPacketPool() {
+    static MemoryPool<AudioStreamPacket, AUDIO_STREAM_PACKET_POOL_SIZE> pool;
+    return pool;
+}
+
+static BufferPool<std::vector<uint8_t>, AUDIO_STREAM_PAYLOAD_POOL_SIZE>& GetPayloadPool() {
+    static BufferPool<std::vector<uint8_t>, AUDIO_STREAM_PAYLOAD_POOL_SIZE> pool(AUDIO_STREAM_PAYLOAD_MAX_CAPACITY);
+    return pool;
+}
+
+AudioStreamPacket::AudioStreamPacket() : payload(GetPayloadPool().Take()) {
+}
+
+AudioStreamPacket::~AudioStreamPacket() {
+    GetPayloadPool().Recycle(payload);
+}
+
+void AudioStreamPacket::AssignWithHeadroom(const uint8_t* data, size_t size) {
+    payload.resize(AUDIO_STREAM_PACKET_HEADROOM + size);
+    std::copy(data, data + size, payload.begin() + AUDIO_STREAM_PACKET_HEADROOM);
+    payload_offset = AUDIO_STREAM_PACKET_HEADROOM;
+}
+
+uint8_t* AudioStreamPacket::PrependHeader(size_t size) {
+    if (payload_offset < size) {
+        payload.insert(payload.begin() + payload_offset, size - payload_offset, 0);
+        payload_offset = size;
+    }
+    payload_offset -= size;
+    return payload_data();
+}
+
+void* AudioStreamPacket::operator new(size_t size) {
+    assert(size == sizeof(AudioStreamPacket));
+    return GetPacketPool().Allocate();
+}
+
+void AudioStreamPacket::operator delete(void* ptr) {
+    GetPacketPool().Free(ptr);
+}
+
+void AudioStreamPacket::TrimPool() {
+    GetPayloadPool().Trim();
+}
+
+void Protocol::OnIncomingJson(std::function<void(const JsonMessage& message)> callback) {
     on_incoming_json_ = callback;
 }
 
@@ -39,6 +86,25 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
+bool Protocol::PreConnect(int keep_alive_seconds) {
+    return false;
+}
+
+void Protocol::CheckPreConnection() {
+}
+
+bool Protocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    bool success = true;
+    for (auto& packet : packets) {
+        if (!SendAudio(std::move(packet))) {
+            success = false;
+            break;
+        }
+    }
+    packets.clear();
+    return success;
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
     if (reason == kAbortReasonWakeWordDetected) {
@@ -78,6 +144,47 @@ void Protocol::SendMcpMessage(const std::string& payload) {
     SendText(message);
 }
 
+void Protocol::ParseEncoderProfile(const cJSON* root) {
+    // Without an "encoder" object the last profile is kept, it is the one the client hello advertised
+    auto encoder = cJSON_GetObjectItem(root, "encoder");
+    if (!cJSON_IsObject(encoder)) {
+        return;
+    }
+    encoder_profile_ = OpusEncoderProfile();
+
+    auto frame_duration = cJSON_GetObjectItem(encoder, "frame_duration");
+    if (cJSON_IsNumber(frame_duration)) {
+        if (frame_duration->valueint == 20 || frame_duration->valueint == 40 || frame_duration->valueint == 60) {
+            encoder_profile_.frame_duration_ms = frame_duration->valueint;
+        } else {
+            ESP_LOGW(TAG, "Unsupported encoder frame duration: %d", frame_duration->valueint);
+        }
+    }
+    auto bitrate = cJSON_GetObjectItem(encoder, "bitrate");
+    if (cJSON_IsNumber(bitrate)) {
+        if (bitrate->valueint == 0 || (bitrate->valueint >= 6000 && bitrate->valueint <= 510000)) {
+            encoder_profile_.bitrate = bitrate->valueint;
+        } else {
+            ESP_LOGW(TAG, "Unsupported encoder bitrate: %d", bitrate->valueint);
+        }
+    }
+    auto complexity = cJSON_GetObjectItem(encoder, "complexity");
+    if (cJSON_IsNumber(complexity)) {
+        encoder_profile_.complexity = std::clamp(complexity->valueint, 0, 10);
+    }
+    auto fec = cJSON_GetObjectItem(encoder, "fec");
+    if (cJSON_IsBool(fec)) {
+        encoder_profile_.enable_fec = cJSON_IsTrue(fec);
+    }
+    auto dtx = cJSON_GetObjectItem(encoder, "dtx");
+    if (cJSON_IsBool(dtx)) {
+        encoder_profile_.enable_dtx = cJSON_IsTrue(dtx);
+    }
+    ESP_LOGI(TAG, "Encoder profile: %d ms, bitrate %d, complexity %d, fec %d, dtx %d",
+        encoder_profile_.frame_duration_ms, encoder_profile_.bitrate, encoder_profile_.complexity,
+        encoder_profile_.enable_fec, encoder_profile_.enable_dtx);
+}
+
 bool Protocol::IsTimeout() const {
     const int kTimeoutSeconds = 120;
     auto now = std::chrono::steady_clock::now();
@@ -6,12 +6,49 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
 
+#include "memory_pool.h"
+#include "json_message.h"
+
+#define AUDIO_STREAM_PACKET_POOL_SIZE 64
+#define AUDIO_STREAM_PAYLOAD_POOL_SIZE 16
+#define AUDIO_STREAM_PAYLOAD_MAX_CAPACITY 1500
+// Bytes left in front of uplink payloads for the largest transport header (BinaryProtocol2), so it is written in place
+#define AUDIO_STREAM_PACKET_HEADROOM 16
+
+/*
+ * Packets are allocated from a fixed slab and their payload storage is recycled,
+ * so streaming does not allocate from the heap once the pools are warm.
+ */
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    // Transport sequence number, 0 if the transport does not have one
+    uint32_t sequence = 0;
+    // Latency tracing (esp_timer time), 0 if not traced: capture or receive time, and when the last stage finished
+    int64_t origin_time_us = 0;
+    int64_t stage_time_us = 0;
+    // The data starts at payload_offset, the bytes in front of it are headroom for a transport header
     std::vector<uint8_t> payload;
+    size_t payload_offset = 0;
+
+    AudioStreamPacket();
+    ~AudioStreamPacket();
+
+    uint8_t* payload_data() { return payload.data() + payload_offset; }
+    const uint8_t* payload_data() const { return payload.data() + payload_offset; }
+    size_t payload_size() const { return payload.size() - payload_offset; }
+    // Store the data behind AUDIO_STREAM_PACKET_HEADROOM bytes of headroom
+    void AssignWithHeadroom(const uint8_t* data, size_t size);
+    // Move the start of the data back over a header of the given size and return it, the data is not moved.
+    // Without enough headroom the data is shifted instead.
+    uint8_t* PrependHeader(size_t size);
+
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+    static void TrimPool();
 };
 
 struct BinaryProtocol2 {
@@ -30,6 +67,20 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+/*
+ * Opus encoder settings for the uplink, the server can choose them in its hello message:
+ * "encoder": {"frame_duration": 20, "bitrate": 16000, "complexity": 3, "fec": true, "dtx": true}
+ */
+struct OpusEncoderProfile {
+    int frame_duration_ms = 60;     // 20, 40 or 60
+    int bitrate = 0;                // bps, 0 for auto
+    int complexity = 0;             // 0 - 10
+    bool enable_fec = false;
+    bool enable_dtx = true;
+
+    bool operator==(const OpusEncoderProfile& other) const = default;
+};
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -54,9 +105,12 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    inline const OpusEncoderProfile& encoder_profile() const {
+        return encoder_profile_;
+    }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingJson(std::function<void(const JsonMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -67,7 +121,13 @@ public:
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel(bool send_goodbye = true) = 0;
     virtual bool IsAudioChannelOpened() const = 0;
+    // Set up the transport ahead of OpenAudioChannel(), e.g. when speech is heard before the wake word.
+    // An unused connection is dropped by CheckPreConnection() after keep_alive_seconds.
+    virtual bool PreConnect(int keep_alive_seconds);
+    virtual void CheckPreConnection();
     virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // Send the packets in order, stops at the first failure. The vector is emptied either way.
+    virtual bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -75,7 +135,7 @@ public:
     virtual void SendMcpMessage(const std::string& message);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const JsonMessage& message)> on_incoming_json_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -85,10 +145,12 @@ protected:
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    OpusEncoderProfile encoder_profile_;
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
+    void ParseEncoderProfile(const cJSON* root);
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
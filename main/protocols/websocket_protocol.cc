@@ -7,6 +7,7 @@
 #include <cstring>
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
@@ -26,34 +27,45 @@ bool WebsocketProtocol::Start() {
 }
 
 bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+    return SendAudioFrame(*packet);
+}
 
+bool WebsocketProtocol::SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    bool success = websocket_ != nullptr && websocket_->IsConnected();
+    for (size_t i = 0; success && i < packets.size(); i++) {
+        success = SendAudioFrame(*packets[i]);
+    }
+    packets.clear();
+    return success;
+}
+
+bool WebsocketProtocol::SendAudioFrame(AudioStreamPacket& packet) {
+    // The packet is ours now, so the header is written into its headroom instead of a new buffer
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        size_t payload_size = packet.payload_size();
+        auto bp2 = (BinaryProtocol2*)packet.PrependHeader(sizeof(BinaryProtocol2));
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
-        bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(payload_size);
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        return websocket_->Send(packet.payload_data(), packet.payload_size(), true);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        size_t payload_size = packet.payload_size();
+        auto bp3 = (BinaryProtocol3*)packet.PrependHeader(sizeof(BinaryProtocol3));
         bp3->type = 0;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(payload_size);
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        return websocket_->Send(packet.payload_data(), packet.payload_size(), true);
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        return websocket_->Send(packet.payload_data(), packet.payload_size(), true);
     }
 }
 
@@ -72,15 +84,96 @@ bool WebsocketProtocol::SendText(const std::string& text) {
 }
 
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+    return websocket_ != nullptr && websocket_->IsConnected() && !preconnected_ && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel(bool send_goodbye) {
     (void)send_goodbye;  // Websocket doesn't need to send goodbye message
+    std::lock_guard<std::mutex> connect_lock(connect_mutex_);
+    std::lock_guard<std::mutex> lock(channel_mutex_);
     websocket_.reset();
+    preconnected_ = false;
+}
+
+bool WebsocketProtocol::PreConnect(int keep_alive_seconds) {
+    std::lock_guard<std::mutex> connect_lock(connect_mutex_);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(keep_alive_seconds);
+    {
+        std::lock_guard<std::mutex> lock(channel_mutex_);
+        if (websocket_ != nullptr && websocket_->IsConnected()) {
+            if (preconnected_) {
+                preconnect_deadline_ = deadline;
+            }
+            return true;
+        }
+        preconnected_ = true;
+    }
+
+    ESP_LOGI(TAG, "Pre-connecting to websocket server");
+    bool connected = Connect(false);
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (!connected) {
+        websocket_.reset();
+        preconnected_ = false;
+        return false;
+    }
+    preconnect_deadline_ = deadline;
+    return true;
+}
+
+void WebsocketProtocol::CheckPreConnection() {
+    // Called from the main loop, a connection that is still being set up is checked on a later tick
+    std::unique_lock<std::mutex> connect_lock(connect_mutex_, std::try_to_lock);
+    if (!connect_lock.owns_lock()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    if (!preconnected_ || std::chrono::steady_clock::now() < preconnect_deadline_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Closing unused pre-connected websocket");
+    websocket_.reset();
+    preconnected_ = false;
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+    error_occurred_ = false;
+
+    // Waits for a pre-connect that is still in progress, then uses its connection
+    std::lock_guard<std::mutex> connect_lock(connect_mutex_);
+    std::unique_lock<std::mutex> channel_lock(channel_mutex_);
+    bool reuse = preconnected_ && websocket_ != nullptr && websocket_->IsConnected();
+    preconnected_ = false;
+    channel_lock.unlock();
+
+    if (reuse) {
+        ESP_LOGI(TAG, "Using the pre-connected websocket");
+    } else if (!Connect(true)) {
+        return false;
+    }
+
+    // Send hello message to describe the client
+    auto message = GetHelloMessage();
+    if (!SendText(message)) {
+        return false;
+    }
+
+    // Wait for server hello
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+        ESP_LOGE(TAG, "Failed to receive server hello");
+        SetError(Lang::Strings::SERVER_TIMEOUT);
+        return false;
+    }
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+
+    return true;
+}
+
+bool WebsocketProtocol::Connect(bool report_error) {
     Settings settings("websocket", false);
     std::string url = settings.GetString("url");
     std::string token = settings.GetString("token");
@@ -89,10 +182,10 @@ bool WebsocketProtocol::OpenAudioChannel() {
         version_ = version;
     }
 
-    error_occurred_ = false;
-
     auto network = Board::GetInstance().GetNetwork();
+    std::unique_lock<std::mutex> channel_lock(channel_mutex_);
     websocket_ = network->CreateWebSocket(1);
+    channel_lock.unlock();
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -112,60 +205,64 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
             if (on_incoming_audio_ != nullptr) {
+                /*
+                 * The frame buffer belongs to the websocket and is reused, so the payload is copied once,
+                 * straight into a pooled packet. The header is read in place and left untouched.
+                 */
+                auto packet = std::make_unique<AudioStreamPacket>();
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                packet->origin_time_us = esp_timer_get_time();
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
+                    if (len < sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    size_t payload_size = std::min<size_t>(ntohl(bp2->payload_size), len - sizeof(BinaryProtocol2));
+                    packet->timestamp = ntohl(bp2->timestamp);
+                    packet->payload.assign(bp2->payload, bp2->payload + payload_size);
                 } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
+                    if (len < sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    size_t payload_size = std::min<size_t>(ntohs(bp3->payload_size), len - sizeof(BinaryProtocol3));
+                    packet->payload.assign(bp3->payload, bp3->payload + payload_size);
                 } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    packet->payload.assign((const uint8_t*)data, (const uint8_t*)data + len);
                 }
+                on_incoming_audio_(std::move(packet));
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
+            // Scanned in place, only the rare hello message is parsed into a cJSON tree
+            JsonMessage message(data, len);
+            if (message.IsString("type")) {
+                if (message.type() == kJsonMessageHello) {
+                    auto root = cJSON_ParseWithLength(data, len);
+                    if (root != nullptr) {
+                        ParseServerHello(root);
+                        cJSON_Delete(root);
+                    }
                 } else {
                     if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
+                        on_incoming_json_(message);
                     }
                 }
             } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
+                ESP_LOGE(TAG, "Missing message type, data: %.*s", (int)len, data);
             }
-            cJSON_Delete(root);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
+        if (preconnected_) {
+            // No channel was opened on it, so there is nothing to close
+            ESP_LOGI(TAG, "Pre-connected websocket disconnected");
+            return;
+        }
         ESP_LOGI(TAG, "Websocket disconnected");
         if (on_audio_channel_closed_ != nullptr) {
             on_audio_channel_closed_();
@@ -175,28 +272,11 @@ bool WebsocketProtocol::OpenAudioChannel() {
     ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
     if (!websocket_->Connect(url.c_str())) {
         ESP_LOGE(TAG, "Failed to connect to websocket server, code=%d", websocket_->GetLastError());
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
-        return false;
-    }
-
-    // Send hello message to describe the client
-    auto message = GetHelloMessage();
-    if (!SendText(message)) {
-        return false;
-    }
-
-    // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
-    if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
-        ESP_LOGE(TAG, "Failed to receive server hello");
-        SetError(Lang::Strings::SERVER_TIMEOUT);
+        if (report_error) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
-
-    if (on_audio_channel_opened_ != nullptr) {
-        on_audio_channel_opened_();
-    }
-
     return true;
 }
 
@@ -210,13 +290,15 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+    cJSON_AddBoolToObject(features, "encoder_profile", true);
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    // The profile negotiated last is kept until the server asks for another one, so the encoder still uses it
+    cJSON_AddNumberToObject(audio_params, "frame_duration", encoder_profile_.frame_duration_ms);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -249,6 +331,7 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
             server_frame_duration_ = frame_duration->valueint;
         }
     }
+    ParseEncoderProfile(root);
 
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
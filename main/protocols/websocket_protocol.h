@@ -5,6 +5,9 @@
 #include "protocol.h"
 
 #include <web_socket.h>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
@@ -17,16 +20,28 @@ public:
 
     bool Start() override;
     bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudioBatch(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    bool PreConnect(int keep_alive_seconds) override;
+    void CheckPreConnection() override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
+    // Audio is sent from its own task, so the websocket must not be replaced while a frame is being written
+    std::mutex channel_mutex_;
+    // Held while a connection is set up, a pre-connect runs in its own task and OpenAudioChannel() waits for it
+    std::mutex connect_mutex_;
     int version_ = 1;
+    // Connected ahead of OpenAudioChannel(), but no hello was sent so the server has no session yet
+    std::atomic<bool> preconnected_ = false;
+    std::chrono::steady_clock::time_point preconnect_deadline_;
 
+    bool Connect(bool report_error);
     void ParseServerHello(const cJSON* root);
+    bool SendAudioFrame(AudioStreamPacket& packet);
     bool SendText(const std::string& text) override;
     std::string GetHelloMessage();
 };